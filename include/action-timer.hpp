@@ -34,7 +34,9 @@ either expressed or implied, of the FreeBSD Project.
 
 #include <atomic>
 #include <condition_variable>
+#include <cstdint>
 #include <functional>
+#include <iterator>
 #include <list>
 #include <memory>
 #include <map>
@@ -42,13 +44,16 @@ either expressed or implied, of the FreeBSD Project.
 #include <random>
 #include <thread>
 #include <utility>
+#include <vector>
 
 #include <time.h>
 
 #include "locking-container.hpp"
 
 #include "action.hpp"
+#include "alias-table.hpp"
 #include "category-tree.hpp"
+#include "persistent-category-tree.hpp"
 #include "timer.hpp"
 
 struct abstract_scaled_timer {
@@ -57,7 +62,33 @@ struct abstract_scaled_timer {
   virtual double get_scale()             = 0;
 };
 
-template <class Category>
+// Size is the type used for lambda. With an integral Size (e.g., uint64_t),
+// lambdas are exact, and categories are selected with an exact integer draw,
+// so the total rate never drifts no matter how many times timers are updated.
+//
+// Tree is the container used for the timers, e.g., category_tree (the
+// default), wide_category_trees <Width> ::type for very many timers, or
+// small_category_tables <N> ::type when there are only a few timers. If the
+// container has a fixed capacity, set_timer returns false once it's full.
+//
+// Generator is the random-number generator. Each timer thread has its own,
+// derived from the seed passed to the constructor, so the threads never share
+// random state. If Generator has jump() (e.g., xoshiro256_starstar, which is
+// also much faster than the default), the threads use non-overlapping streams
+// of the same sequence; otherwise, each thread seeds its own generator with a
+// std::seed_seq of the seed and its stream number. With a counter-based
+// Generator (e.g., philox4x32), the random numbers for the k-th event are a
+// pure function of the seed and k, so the sequence of categories and
+// exponential draws is the same for any number of threads. (Only which thread
+// handles each event, and so the exact trigger order, can differ.) This is why
+// snapshot sampling is ignored with a counter-based Generator: whether an event
+// uses the snapshot depends on timing, and the snapshot maps the same draw to
+// a different category than the timers do. Also, since the timers are ordered
+// by slot index (see timer_key), the same draw only selects the same category
+// if the slots were created and released in the same order, i.e., if the calls
+// that modified the timer are replayed in order.
+template <class Category, class Size = double, template <class...> class Tree = category_tree,
+          class Generator = std::default_random_engine>
 class action_timer : public abstract_scaled_timer {
 public:
   // The number of threads is primarily intended for making timing more accurate
@@ -65,12 +96,16 @@ public:
   // multiplied by n, which decreases the ratio of overhead to actual sleeping
   // time, which allows shorter sleeps to be more accurate.
   explicit action_timer(unsigned int threads = 1, int seed = time(nullptr)) :
-  thread_count(threads), stop_called(true), stopped(true), generator(seed), locked_scale(1.0) {}
+  thread_count(threads), stop_called(true), stopped(true), seed(seed), start_count(0),
+  event_count(0), current_scale(1.0), snapshot_sampling(false), samples_since_update(0),
+  snapshot_threshold(0), lock_free_sampling(false), publish_count(0) {}
 
   explicit action_timer(unsigned int threads, std::function <sleep_timer*()> factory,
                         int seed = time(nullptr)) :
   thread_count(threads), timer_factory(std::move(factory)), stop_called(true),
-  stopped(true), generator(seed), locked_scale(1.0) {}
+  stopped(true), seed(seed), start_count(0), event_count(0), current_scale(1.0),
+  snapshot_sampling(false), samples_since_update(0), snapshot_threshold(0),
+  lock_free_sampling(false), publish_count(0) {}
 
   // NOTE: It's an error to call this when threads are running.
   void set_timer_factory(std::function <sleep_timer*()> factory);
@@ -78,17 +113,75 @@ public:
   void set_scale(double scale);
   double get_scale();
 
-  bool set_timer(const Category &category, double lambda, bool overwrite = true);
+  // When enabled, the timer threads sample categories from an alias_table
+  // snapshot of the timers, which is O(1) rather than O(log n) and doesn't
+  // require locking the timers. The snapshot is discarded by set_timer and
+  // erase_timer, and it's only rebuilt after enough samples have been taken
+  // from the timers to pay for the O(n) rebuild. If the timers change more
+  // often than that, sampling just continues to use the timers directly.
+  // NOTE: This has no effect with a counter-based Generator. (See the comments
+  // for the class.)
+  void set_snapshot_sampling(bool enabled);
+
+  // When enabled, the timer threads don't acquire any locks per event. Each
+  // function that modifies the timers publishes one immutable version of them
+  // (so batches are still seen all at once), which each thread reloads only
+  // when it changes. Updating a timer copies O(log n) nodes of a
+  // persistent_category_tree. Enabling this is O(n log n), and it takes
+  // precedence over snapshot sampling.
+  // NOTE: This ignores Tree, since the versions use a persistent_category_tree.
+  void set_lock_free_sampling(bool enabled);
+
+  bool set_timer(const Category &category, Size lambda, bool overwrite = true);
   void erase_timer(const Category &category);
+
+  // Batch versions of set_timer and erase_timer. [begin, end) contains
+  // (Category, lambda) pairs or categories, respectively. The whole batch is
+  // applied under a single lock with a single wakeup, so the timer threads
+  // only ever see the state before or after the entire batch. set_timers
+  // returns the number of timers set, which can be less than the batch size
+  // when overwrite is false or the container is full. A category repeated in
+  // the batch is handled as if set_timer were called for each, in order.
+  template <class Iterator>
+  std::size_t set_timers(Iterator begin, Iterator end, bool overwrite = true);
+  template <class Iterator>
+  void erase_timers(Iterator begin, Iterator end);
   bool timer_exists(const Category &category);
 
   // Ideally, async_action (or similar) should be used so that the amount of
   // time spent on the action by the timer thread is extremely small, with the
   // actual execution of the action happening in a dedicated thread.
+  // Once set_action or erase_action returns, the old action isn't being
+  // triggered, and it won't be triggered again. For that reason, an action
+  // must not replace or erase itself from within trigger_action.
   bool set_action(const Category &category, generic_action action, bool overwrite = true);
   void erase_action(const Category &category);
   bool action_exists(const Category &category);
 
+  // A stable reference to a category, for updating the same categories often.
+  // The functions that take a handle don't compare any categories; they find
+  // the category in O(1), and then updating the timer is O(log n). (The key
+  // functions above only compare categories once, to find the handle.) Once
+  // erase is called, the handle is invalid, even if the category is created
+  // again later.
+  struct handle {
+    std::uint32_t index      = 0;
+    std::uint32_t generation = 0;
+  };
+
+  // Returns the handle for category, creating the category if necessary. The
+  // category is kept until erase is called, even without a timer or an action.
+  handle get_handle(const Category &category);
+  bool handle_exists(const handle &category);
+
+  // These return false if the handle is invalid. Otherwise, they're the same
+  // as set_timer and set_action with overwrite = true.
+  bool set_rate(const handle &category, Size lambda);
+  bool set_action(const handle &category, generic_action action);
+  // Erases the timer and the action, and invalidates the handle, all at once,
+  // so that a concurrent set_rate or set_action can't keep the handle valid.
+  void erase(const handle &category);
+
   // Start the timer threads. It's an error to call this when the threads are
   // already running.
   void start();
@@ -125,16 +218,194 @@ public:
 private:
   void join();
 
-  void thread_loop(unsigned int thread_number);
+  void thread_loop(unsigned int thread_number, Generator generator);
+
+  // Creates the generator for one thread. (See the comments for the class.)
+  // stream is unique to each thread across all calls to start.
+  template <class Stream>
+  static auto make_generator(int seed, unsigned int stream, int)
+    -> decltype(std::declval <Stream&> ().set_stream(0), Stream()) {
+    // Each event gets its own stream. (See start_event.)
+    return Stream(seed);
+  }
+  template <class Stream>
+  static auto make_generator(int seed, unsigned int stream, long)
+    -> decltype(std::declval <Stream&> ().jump(), Stream()) {
+    Stream generator(seed);
+    for (unsigned int i = 0; i < stream; ++i) {
+      generator.jump();
+    }
+    return generator;
+  }
+  template <class Stream>
+  static Stream make_generator(int seed, unsigned int stream, ...) {
+    std::seed_seq sequence { seed, (int) stream };
+    return Stream(sequence);
+  }
+
+  // Returns true for counter-based generators. (See start_event.)
+  template <class Stream>
+  static constexpr auto is_counter_based(int)
+    -> decltype(std::declval <Stream&> ().set_stream(0), bool()) {
+    return true;
+  }
+  template <class Stream>
+  static constexpr bool is_counter_based(long) {
+    return false;
+  }
+
+  // For counter-based generators (e.g., philox4x32), switches to the stream
+  // for the next event, so that the random numbers for the k-th event only
+  // depend on the seed and k, regardless of which thread handles it.
+  template <class Stream>
+  auto start_event(Stream &generator, int) -> decltype(generator.set_stream(0), void()) {
+    generator.set_stream(event_count++);
+  }
+  template <class Stream>
+  void start_event(Stream &generator, long) {}
+
+  typedef std::uint32_t index_type;
+
+  // Everything that's shared between the timer and the action for a category.
+  // The timers are keyed by this, so that locating a timer also locates its
+  // action without a second lookup by Category.
+  struct action_slot {
+    action_slot(const Category &new_category, index_type new_index) :
+    category(new_category), index(new_index), action(nullptr), triggering(0),
+    replacing(0), has_timer(false), has_handle(false) {}
+
+    ~action_slot() {
+      delete action.load();
+    }
 
-  typedef lc::locking_container <category_tree <Category, double>, lc::rw_lock>
+    const Category   category;
+    const index_type index;
+    // NOTE: action is owned by the slot, and it's only replaced while holding
+    // the write lock for locked_slots. (See replace_action.)
+    std::atomic <abstract_action*> action;
+    // The number of threads currently triggering action, and the number of
+    // threads waiting for them to finish so that they can replace it. New
+    // triggers wait while replacing is nonzero, so that replacing can't starve.
+    std::atomic <unsigned int> triggering, replacing;
+    // NOTE: These must only be accessed while holding locked_slots.
+    bool has_timer, has_handle;
+  };
+
+  typedef std::shared_ptr <action_slot> slot_pointer;
+
+  // The key used for the timers. Only index is used for comparisons, so the
+  // timers never compare categories, and a key without a slot can be used to
+  // find or erase a timer.
+  // NOTE: This means that the order of the timers, and so which category a
+  // given random draw selects, depends on the order that slots were created
+  // and released in, rather than on Category.
+  struct timer_key {
+    timer_key() = default;
+    explicit timer_key(index_type new_index, slot_pointer new_slot = slot_pointer()) :
+    index(new_index), slot(std::move(new_slot)) {}
+
+    bool operator < (const timer_key &other) const {
+      return index < other.index;
+    }
+
+    bool operator == (const timer_key &other) const {
+      return index == other.index;
+    }
+
+    index_type   index;
+    slot_pointer slot;
+  };
+
+  // Returns false if the thread should exit.
+  bool sleep_and_trigger(const slot_pointer &slot, double time, sleep_timer &timer);
+
+  // A slot is kept for as long as it has a timer, an action, or a handle, so
+  // that all of them agree on the slot. Released indices are reused, with a
+  // new generation.
+  struct slot_registry {
+    // NOTE: Category is already required to be sortable by category_tree. Since
+    // the log(n) price is already being paid, this is a map so that we don't
+    // have to also impose hashability on Category.
+    std::map <Category, slot_pointer> by_category;
+    std::vector <slot_pointer>        by_index;
+    std::vector <std::uint32_t>       generations;
+    std::vector <index_type>          free_indices;
+  };
+
+  // Returns the slot for category, creating it if necessary.
+  // NOTE: The caller must hold the write lock for locked_slots.
+  static slot_pointer get_slot(slot_registry &slots, const Category &category);
+  // These return nullptr if the slot doesn't exist.
+  static slot_pointer find_slot(const slot_registry &slots, const Category &category);
+  static slot_pointer find_slot(const slot_registry &slots, const handle &category);
+  // Replaces the action for the slot, returning the old action. The old action
+  // must not be destructed until after wait_for_triggers.
+  // NOTE: The caller must hold the write lock for locked_slots.
+  static generic_action replace_action(const slot_pointer &slot, generic_action action);
+  // Waits for all threads that might be triggering the slot's old action to
+  // finish. Call this after replace_action, but without holding locked_slots,
+  // since the action itself might need it.
+  static void wait_for_triggers(const slot_pointer &slot);
+  // Triggers the slot's action, if it has one. Returns false if the action
+  // should be removed.
+  static bool trigger_slot(const slot_pointer &slot);
+
+  // Removes the slot if it has no timer, action, or handle.
+  // NOTE: The caller must hold the write lock for locked_slots.
+  static void release_slot(slot_registry &slots, const slot_pointer &slot);
+
+  // The implementations shared by the key and handle functions. find is called
+  // with the slot_registry, and it returns the slot to use, or nullptr.
+  template <class Find>
+  bool set_slot_timer(const Find &find, Size lambda, bool overwrite);
+  template <class Find>
+  void erase_slot_timer(const Find &find);
+  template <class Find>
+  bool set_slot_action(const Find &find, generic_action action, bool overwrite);
+  template <class Find>
+  void erase_slot_action(const Find &find);
+
+  // Wakes up any threads waiting for the timers to change.
+  void notify_timers_changed();
+
+  typedef persistent_category_tree <timer_key, Size> published_category_tree;
+
+  typedef std::shared_ptr <const typename published_category_tree::version> published_version;
+
+  // Reloads categories if anything has been published since version.
+  void reload_published(unsigned long &version, published_version &categories);
+
+  // Publishes the current version of published_categories.
+  // NOTE: The caller must hold the write lock for locked_categories.
+  void publish();
+
+  typedef Tree <timer_key, Size> category_tree_type;
+  // NOTE: The snapshot always uses double, since alias_table needs to split
+  // the unit interval even when Size is integral.
+  typedef alias_table <timer_key, double> category_snapshot;
+
+  // Returns false if the container rejected the update, for containers whose
+  // update_category returns bool. (See small_category_table.)
+  template <class Container>
+  static auto update_timer(Container &categories, const timer_key &category, Size lambda, int)
+    -> decltype(bool(categories.update_category(category, lambda))) {
+    return categories.update_category(category, lambda);
+  }
+  template <class Container>
+  static bool update_timer(Container &categories, const timer_key &category, Size lambda, long) {
+    categories.update_category(category, lambda);
+    return true;
+  }
+
+  // NOTE: The caller must hold the write lock for locked_categories.
+  void invalidate_snapshot();
+  // NOTE: The caller must hold a read lock for locked_categories.
+  void rebuild_snapshot(const category_tree_type &categories);
+
+  typedef lc::locking_container <category_tree_type, lc::rw_lock>
     locked_category_tree;
 
-  // NOTE: Category is already required to be sortable by category_tree. Since
-  // the log(n) price is already being paid, this is a map so that we don't have
-  // to also impose hashability on Category.
-  typedef std::map <Category, generic_action> action_map;
-  typedef lc::locking_container <action_map, lc::rw_lock> locked_action_map;
+  typedef lc::locking_container <slot_registry, lc::rw_lock> locked_slot_registry;
 
   // NOTE: All members besides threads and timer_factory need to be thread-safe!
 
@@ -146,143 +417,502 @@ private:
   std::condition_variable state_wait;
   std::atomic <bool> stop_called, stopped;
 
-  std::default_random_engine generator;
-  std::uniform_real_distribution <double> uniform;
-  std::exponential_distribution <double>  exponential;
+  const int seed;
+  // The number of times start has been called, so that the threads don't
+  // repeat the same random sequences after a restart.
+  unsigned int start_count;
+  // The number of events sampled so far, for counter-based generators.
+  std::atomic <std::uint64_t> event_count;
 
-  lc::locking_container <double, lc::rw_lock> locked_scale;
+  std::atomic <double> current_scale;
 
   locked_category_tree locked_categories;
-  locked_action_map    locked_actions;
+  // NOTE: locked_slots is always locked after locked_categories, and never
+  // while triggering an action, so locking both can't deadlock.
+  locked_slot_registry locked_slots;
+
+  // NOTE: snapshot must only be accessed with std::atomic_load/atomic_store.
+  std::atomic <bool> snapshot_sampling;
+  std::shared_ptr <const category_snapshot> snapshot;
+  std::mutex snapshot_lock;
+  // Rebuilding the snapshot is O(n) for n categories, so it's only done once
+  // at least snapshot_threshold samples have come from the timers since the
+  // last update, which makes the rebuild cost O(1) per sample.
+  std::atomic <unsigned long> samples_since_update;
+  std::atomic <unsigned long> snapshot_threshold;
+
+  // NOTE: published_categories is only maintained while lock_free_sampling is
+  // enabled, and lock_free_sampling and published_categories are only modified
+  // while holding the write lock for locked_categories. published must only be
+  // accessed with std::atomic_load/atomic_store.
+  std::atomic <bool> lock_free_sampling;
+  published_category_tree published_categories;
+  published_version       published;
+  // Incremented after published is replaced, so that the threads only need to
+  // load published (which might lock internally) when something changed.
+  std::atomic <unsigned long> publish_count;
+
+#ifdef TESTING
+  FRIEND_TEST(action_timer_test, snapshot_sampling_follows_erase);
+#endif
 };
 
 
-template <class Category>
-void action_timer <Category> ::set_timer_factory(std::function <sleep_timer*()> factory) {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::set_timer_factory(std::function <sleep_timer*()> factory) {
   assert(this->is_stopped());
   timer_factory.swap(factory);
 }
 
-template <class Category>
-void action_timer <Category> ::set_scale(double scale) {
-  auto scale_write = locked_scale.get_write();
-  assert(scale_write);
-  *scale_write = scale;
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::set_scale(double scale) {
+  current_scale = scale;
 }
 
-template <class Category>
-double action_timer <Category> ::get_scale() {
-  auto scale_read = locked_scale.get_read();
-  assert(scale_read);
-  return *scale_read;
+template <class Category, class Size, template <class...> class Tree, class Generator>
+double action_timer <Category, Size, Tree, Generator> ::get_scale() {
+  return current_scale;
 }
 
-template <class Category>
-bool action_timer <Category> ::set_timer(const Category &category, double lambda,
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::set_snapshot_sampling(bool enabled) {
+  snapshot_sampling = enabled && !is_counter_based <Generator> (0);
+  if (!enabled) {
+    std::atomic_store(&snapshot, std::shared_ptr <const category_snapshot> ());
+  }
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::set_lock_free_sampling(bool enabled) {
+  lc::lock_auth_base::auth_type auth(new lc::lock_auth <lc::w_lock>);
+  auto category_write = locked_categories.get_write_auth(auth);
+  assert(category_write);
+  if (enabled == lock_free_sampling) {
+    return;
+  }
+  if (enabled) {
+    category_write->for_each([this](const timer_key &category, Size size) {
+      published_categories.update_category(category, size);
+    });
+    lock_free_sampling = true;
+  } else {
+    lock_free_sampling = false;
+    published_categories.clear();
+  }
+  this->publish();
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::set_timer(const Category &category, Size lambda,
                                          bool overwrite) {
+  return this->set_slot_timer([&category](slot_registry &slots) { return get_slot(slots, category); },
+                              lambda, overwrite);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::erase_timer(const Category &category) {
+  this->erase_slot_timer([&category](slot_registry &slots) { return find_slot(slots, category); });
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+template <class Iterator>
+std::size_t action_timer <Category, Size, Tree, Generator> ::set_timers(Iterator begin, Iterator end, bool overwrite) {
+  lc::lock_auth_base::auth_type auth(new lc::lock_auth <lc::w_lock>);
+  auto category_write = locked_categories.get_write_auth(auth);
+  assert(category_write);
+  auto slot_write = locked_slots.get_write();
+  assert(slot_write);
+  std::vector <std::pair <timer_key, Size>> updates;
+  for (; begin != end; ++begin) {
+    assert(begin->second > 0);
+    const slot_pointer slot = get_slot(*slot_write, begin->first);
+    // NOTE: has_timer is set here so that a category that's repeated in the
+    // batch is skipped when overwrite is false, the same as with set_timer.
+    if (overwrite || !slot->has_timer) {
+      slot->has_timer = true;
+      updates.emplace_back(timer_key(slot->index, slot), begin->second);
+    }
+  }
+  category_write->update_categories(updates.begin(), updates.end());
+  std::size_t updated = 0;
+  for (const auto &update : updates) {
+    // NOTE: Some containers reject new categories when they're full.
+    if (category_write->category_exists(update.first)) {
+      ++updated;
+      if (lock_free_sampling) {
+        published_categories.update_category(update.first, update.second);
+      }
+    } else if (update.first.slot->has_timer) {
+      // NOTE: A rejected category can be repeated in the batch, but its slot
+      // must only be released once, since its index is reused afterward.
+      update.first.slot->has_timer = false;
+      release_slot(*slot_write, update.first.slot);
+    }
+  }
+  slot_write.clear();
+  this->invalidate_snapshot();
+  if (lock_free_sampling) {
+    this->publish();
+  }
+  category_write.clear();
+  this->notify_timers_changed();
+  return updated;
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+template <class Iterator>
+void action_timer <Category, Size, Tree, Generator> ::erase_timers(Iterator begin, Iterator end) {
+  lc::lock_auth_base::auth_type auth(new lc::lock_auth <lc::w_lock>);
+  auto category_write = locked_categories.get_write_auth(auth);
+  assert(category_write);
+  auto slot_write = locked_slots.get_write();
+  assert(slot_write);
+  std::vector <timer_key> erased;
+  for (; begin != end; ++begin) {
+    const slot_pointer slot = find_slot(*slot_write, *begin);
+    if (slot && slot->has_timer) {
+      slot->has_timer = false;
+      erased.emplace_back(slot->index, slot);
+    }
+  }
+  category_write->erase_categories(erased.begin(), erased.end());
+  for (const auto &key : erased) {
+    if (lock_free_sampling) {
+      published_categories.erase_category(key);
+    }
+    release_slot(*slot_write, key.slot);
+  }
+  slot_write.clear();
+  this->invalidate_snapshot();
+  if (lock_free_sampling) {
+    this->publish();
+  }
+  category_write.clear();
+  this->notify_timers_changed();
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::timer_exists(const Category &category) {
+  auto slot_read = locked_slots.get_read();
+  assert(slot_read);
+  const slot_pointer slot = find_slot(*slot_read, category);
+  return slot && slot->has_timer;
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::set_action(const Category &category,
+                                          generic_action action, bool overwrite) {
+  return this->set_slot_action([&category](slot_registry &slots) { return get_slot(slots, category); },
+                               std::move(action), overwrite);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::erase_action(const Category &category) {
+  this->erase_slot_action([&category](slot_registry &slots) { return find_slot(slots, category); });
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::action_exists(const Category &category) {
+  auto slot_read = locked_slots.get_read();
+  assert(slot_read);
+  const slot_pointer slot = find_slot(*slot_read, category);
+  return slot && slot->action.load();
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+auto action_timer <Category, Size, Tree, Generator> ::get_handle(const Category &category) -> handle {
+  auto slot_write = locked_slots.get_write();
+  assert(slot_write);
+  const slot_pointer slot = get_slot(*slot_write, category);
+  slot->has_handle = true;
+  handle new_handle;
+  new_handle.index      = slot->index;
+  new_handle.generation = slot_write->generations[slot->index];
+  return new_handle;
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::handle_exists(const handle &category) {
+  auto slot_read = locked_slots.get_read();
+  assert(slot_read);
+  return (bool) find_slot(*slot_read, category);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::set_rate(const handle &category, Size lambda) {
+  return this->set_slot_timer([&category](slot_registry &slots) { return find_slot(slots, category); },
+                              lambda, true);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::set_action(const handle &category,
+                                          generic_action action) {
+  return this->set_slot_action([&category](slot_registry &slots) { return find_slot(slots, category); },
+                               std::move(action), true);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::erase(const handle &category) {
+  // NOTE: This is all done in one critical section so that nothing else can
+  // use the handle while it's being invalidated.
+  lc::lock_auth_base::auth_type auth(new lc::lock_auth <lc::w_lock>);
+  auto category_write = locked_categories.get_write_auth(auth);
+  assert(category_write);
+  auto slot_write = locked_slots.get_write();
+  assert(slot_write);
+  const slot_pointer slot = find_slot(*slot_write, category);
+  if (!slot) {
+    return;
+  }
+  const bool had_timer = slot->has_timer;
+  const timer_key key(slot->index);
+  slot->has_handle = false;
+  if (had_timer) {
+    category_write->erase_category(key);
+    slot->has_timer = false;
+  }
+  // NOTE: The action is moved here so that destruction is called after both
+  // locks are released, in case the destructor is non-trivial.
+  const generic_action discard = replace_action(slot, generic_action());
+  release_slot(*slot_write, slot);
+  slot_write.clear();
+  if (had_timer) {
+    this->invalidate_snapshot();
+    if (lock_free_sampling) {
+      published_categories.erase_category(key);
+      this->publish();
+    }
+  }
+  category_write.clear();
+  wait_for_triggers(slot);
+  if (had_timer) {
+    this->notify_timers_changed();
+  }
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+template <class Find>
+bool action_timer <Category, Size, Tree, Generator> ::set_slot_timer(const Find &find, Size lambda, bool overwrite) {
   lc::lock_auth_base::auth_type auth(new lc::lock_auth <lc::w_lock>);
   auto category_write = locked_categories.get_write_auth(auth);
   assert(category_write);
   assert(lambda > 0);
-  if (!overwrite && category_write->category_exists(category)) {
+  auto slot_write = locked_slots.get_write();
+  assert(slot_write);
+  const slot_pointer slot = find(*slot_write);
+  if (!slot) {
+    return false;
+  }
+  if (!overwrite && slot->has_timer) {
+    return false;
+  }
+  const timer_key key(slot->index, slot);
+  if (!update_timer(*category_write, key, lambda, 0)) {
+    release_slot(*slot_write, slot);
     return false;
   }
-  category_write->update_category(category, lambda);
+  slot->has_timer = true;
+  slot_write.clear();
+  this->invalidate_snapshot();
+  if (lock_free_sampling) {
+    published_categories.update_category(key, lambda);
+    this->publish();
+  }
   category_write.clear();
-  // Make sure that no thread gets stuck between locking state_lock and waiting
-  // for state_wait.
-  std::unique_lock <std::mutex> local_lock(state_lock);
-  state_wait.notify_all();
+  this->notify_timers_changed();
   return true;
 }
 
-template <class Category>
-void action_timer <Category> ::erase_timer(const Category &category) {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+template <class Find>
+void action_timer <Category, Size, Tree, Generator> ::erase_slot_timer(const Find &find) {
   lc::lock_auth_base::auth_type auth(new lc::lock_auth <lc::w_lock>);
   auto category_write = locked_categories.get_write_auth(auth);
   assert(category_write);
-  category_write->erase_category(category);
+  auto slot_write = locked_slots.get_write();
+  assert(slot_write);
+  const slot_pointer slot = find(*slot_write);
+  if (!slot || !slot->has_timer) {
+    return;
+  }
+  const timer_key key(slot->index);
+  category_write->erase_category(key);
+  slot->has_timer = false;
+  release_slot(*slot_write, slot);
+  slot_write.clear();
+  this->invalidate_snapshot();
+  if (lock_free_sampling) {
+    published_categories.erase_category(key);
+    this->publish();
+  }
+  category_write.clear();
+  this->notify_timers_changed();
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+template <class Find>
+bool action_timer <Category, Size, Tree, Generator> ::set_slot_action(const Find &find,
+                                               generic_action action, bool overwrite) {
+  assert(action);
+  action->start();
+  auto slot_write = locked_slots.get_write();
+  assert(slot_write);
+  const slot_pointer slot = find(*slot_write);
+  if (!slot || (!overwrite && slot->action.load())) {
+    return false;
+  }
+  // NOTE: The old action is destructed after locked_slots is unlocked, in case
+  // the destructor is non-trivial.
+  const generic_action replaced = replace_action(slot, std::move(action));
+  slot_write.clear();
+  wait_for_triggers(slot);
+  return true;
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+template <class Find>
+void action_timer <Category, Size, Tree, Generator> ::erase_slot_action(const Find &find) {
+  auto slot_write = locked_slots.get_write();
+  assert(slot_write);
+  const slot_pointer slot = find(*slot_write);
+  if (slot) {
+    // NOTE: The action is moved here so that destruction is called after
+    // locked_slots is unlocked, in case the destructor is non-trivial.
+    const generic_action discard = replace_action(slot, generic_action());
+    release_slot(*slot_write, slot);
+    // Forces unlocking before discard is destructed.
+    slot_write.clear();
+    wait_for_triggers(slot);
+  }
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::notify_timers_changed() {
   // Make sure that no thread gets stuck between locking state_lock and waiting
   // for state_wait.
   std::unique_lock <std::mutex> local_lock(state_lock);
   state_wait.notify_all();
 }
 
-template <class Category>
-bool action_timer <Category> ::timer_exists(const Category &category) {
-  auto category_read = locked_categories.get_read();
-  assert(category_read);
-  return category_read->category_exists(category);
+template <class Category, class Size, template <class...> class Tree, class Generator>
+auto action_timer <Category, Size, Tree, Generator> ::get_slot(slot_registry &slots, const Category &category)
+  -> slot_pointer {
+  slot_pointer &slot = slots.by_category[category];
+  if (!slot) {
+    index_type index;
+    if (slots.free_indices.empty()) {
+      index = slots.by_index.size();
+      slots.by_index.emplace_back();
+      slots.generations.push_back(1);
+    } else {
+      index = slots.free_indices.back();
+      slots.free_indices.pop_back();
+    }
+    slot.reset(new action_slot(category, index));
+    slots.by_index[index] = slot;
+  }
+  return slot;
 }
 
-template <class Category>
-bool action_timer <Category> ::set_action(const Category &category,
-                                          generic_action action, bool overwrite) {
-  assert(action);
-  action->start();
-  auto action_write = locked_actions.get_write();
-  assert(action_write);
-  if (!overwrite && action_write->find(category) != action_write->end()) {
-    return false;
+template <class Category, class Size, template <class...> class Tree, class Generator>
+auto action_timer <Category, Size, Tree, Generator> ::find_slot(const slot_registry &slots, const Category &category)
+  -> slot_pointer {
+  auto existing = slots.by_category.find(category);
+  return existing == slots.by_category.end()? slot_pointer() : existing->second;
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+auto action_timer <Category, Size, Tree, Generator> ::find_slot(const slot_registry &slots, const handle &category)
+  -> slot_pointer {
+  if (category.index < slots.by_index.size() &&
+      slots.generations[category.index] == category.generation) {
+    return slots.by_index[category.index];
+  } else {
+    return slot_pointer();
   }
-  // NOTE: swap is used here so that destruction is called after
-  // locked_actions is unlocked, in case the destructor is non-trivial.
-  (*action_write)[category].swap(action);
-  return true;
 }
 
-template <class Category>
-void action_timer <Category> ::erase_action(const Category &category) {
-  auto action_write = locked_actions.get_write();
-  auto existing = action_write->find(category);
-  if (existing != action_write->end()) {
-    generic_action discard;
-    // NOTE: swap is used here so that destruction is called after
-    // locked_actions is unlocked, in case the destructor is non-trivial.
-    existing->second.swap(discard);
-    action_write->erase(existing);
-    // Forces unlocking before discard is destructed.
-    action_write.clear();
+template <class Category, class Size, template <class...> class Tree, class Generator>
+auto action_timer <Category, Size, Tree, Generator> ::replace_action(const slot_pointer &slot, generic_action action)
+  -> generic_action {
+  slot->replacing.fetch_add(1);
+  return generic_action(slot->action.exchange(action.release()));
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::wait_for_triggers(const slot_pointer &slot) {
+  // NOTE: This pairs with trigger_slot. Both sides use sequentially-consistent
+  // operations, so a thread either sees replacing and backs off without loading
+  // the action, or this sees that it's still triggering.
+  while (slot->triggering.load() != 0) {
+    std::this_thread::yield();
   }
+  slot->replacing.fetch_sub(1);
 }
 
-template <class Category>
-bool action_timer <Category> ::action_exists(const Category &category) {
-  auto action_read = locked_actions.get_read();
-  assert(action_read);
-  return action_read->find(category) != action_read->end();
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::trigger_slot(const slot_pointer &slot) {
+  while (true) {
+    slot->triggering.fetch_add(1);
+    if (slot->replacing.load() == 0) {
+      break;
+    }
+    slot->triggering.fetch_sub(1);
+    while (slot->replacing.load() != 0) {
+      std::this_thread::yield();
+    }
+  }
+  abstract_action *const action = slot->action.load();
+  const bool keep = !action || action->trigger_action();
+  slot->triggering.fetch_sub(1);
+  return keep;
 }
 
-template <class Category>
-void action_timer <Category> ::start() {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::release_slot(slot_registry &slots, const slot_pointer &slot) {
+  assert(slot && slots.by_index[slot->index] == slot);
+  if (slot->has_timer || slot->has_handle || slot->action.load()) {
+    return;
+  }
+  const index_type index = slot->index;
+  slots.by_category.erase(slot->category);
+  slots.by_index[index].reset();
+  ++slots.generations[index];
+  slots.free_indices.push_back(index);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::start() {
   assert(this->is_stopped() && threads.empty());
   stopped = stop_called = false;
   for (unsigned int i = 0; i < thread_count; ++i) {
-    threads.emplace_back(new std::thread([this,i] { this->thread_loop(i); }));
+    Generator generator = make_generator <Generator> (seed, start_count * thread_count + i, 0);
+    threads.emplace_back(new std::thread([this,i,generator] { this->thread_loop(i, generator); }));
   }
+  ++start_count;
 }
 
-template <class Category>
-void action_timer <Category> ::stop() {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::stop() {
   this->async_stop();
   this->join();
 }
 
-template <class Category>
-bool action_timer <Category> ::is_stopped() const {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::is_stopped() const {
   return stopped;
 }
 
-template <class Category>
-void action_timer <Category> ::wait_stopped() {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::wait_stopped() {
   while (!this->is_stopped()) {
     std::unique_lock <std::mutex> local_lock(state_lock);
     state_wait.wait(local_lock);
   }
 }
 
-template <class Category>
-void action_timer <Category> ::async_stop() {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::async_stop() {
   // Make sure that no thread gets stuck between locking state_lock and waiting
   // for state_wait.
   std::unique_lock <std::mutex> local_lock(state_lock);
@@ -290,33 +920,33 @@ void action_timer <Category> ::async_stop() {
   state_wait.notify_all();
 }
 
-template <class Category>
-bool action_timer <Category> ::is_stopping() const {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::is_stopping() const {
   return stop_called;
 }
 
-template <class Category>
-void action_timer <Category> ::wait_stopping() {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::wait_stopping() {
   while (!this->is_stopping()) {
     std::unique_lock <std::mutex> local_lock(state_lock);
     state_wait.wait(local_lock);
   }
 }
 
-template <class Category>
-bool action_timer <Category> ::is_empty() {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::is_empty() {
   auto category_read = locked_categories.get_read();
   assert(category_read);
-  return category_read->get_total_size() == 0.0;
+  return category_read->get_total_size() == Size();
 }
 
-template <class Category>
-void action_timer <Category> ::wait_empty() {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::wait_empty() {
   while (!this->is_stopping()) {
     std::unique_lock <std::mutex> local_lock(state_lock);
     auto category_read = locked_categories.get_read();
     assert(category_read);
-    if (category_read->get_total_size() != 0.0) {
+    if (category_read->get_total_size() != Size()) {
       category_read.clear();
       state_wait.wait(local_lock);
       continue;
@@ -326,13 +956,13 @@ void action_timer <Category> ::wait_empty() {
   }
 }
 
-template <class Category>
-action_timer <Category> ::~action_timer() {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+action_timer <Category, Size, Tree, Generator> ::~action_timer() {
   this->stop();
 }
 
-template <class Category>
-void action_timer <Category> ::join() {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::join() {
   while (!threads.empty()) {
     assert(threads.front());
     assert(std::this_thread::get_id() != threads.front()->get_id());
@@ -342,20 +972,59 @@ void action_timer <Category> ::join() {
   stopped = true;
 }
 
-template <class Category>
-void action_timer <Category> ::thread_loop(unsigned int thread_number) {
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::invalidate_snapshot() {
+  samples_since_update = 0;
+  std::atomic_store(&snapshot, std::shared_ptr <const category_snapshot> ());
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::rebuild_snapshot(const category_tree_type &categories) {
+  if (++samples_since_update < snapshot_threshold) {
+    return;
+  }
+  // Rebuilding is left to whichever thread gets here first.
+  std::unique_lock <std::mutex> local_lock(snapshot_lock, std::try_to_lock);
+  if (!local_lock.owns_lock() || std::atomic_load(&snapshot)) {
+    return;
+  }
+  // NOTE: Since the caller holds a read lock, the categories can't change, and
+  // invalidate_snapshot can't be called until after this returns.
+  std::shared_ptr <const category_snapshot> rebuilt(new category_snapshot(categories));
+  snapshot_threshold = rebuilt->category_count();
+  std::atomic_store(&snapshot, rebuilt);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::publish() {
+  std::atomic_store(&published, published_version(
+    new typename published_category_tree::version(published_categories.get_version())));
+  publish_count.fetch_add(1, std::memory_order_release);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::reload_published(unsigned long &version,
+                                                published_version &categories) {
+  // NOTE: The count is loaded first, so that version is never newer than categories.
+  const unsigned long current = publish_count.load(std::memory_order_acquire);
+  if (current != version) {
+    categories = std::atomic_load(&published);
+    version    = current;
+  }
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void action_timer <Category, Size, Tree, Generator> ::thread_loop(unsigned int thread_number, Generator generator) {
   lc::lock_auth_base::auth_type auth(new lc::lock_auth <lc::rw_lock>);
   // NOTE: This *must* be unique to this thread!
   std::unique_ptr <sleep_timer> timer(timer_factory? timer_factory() : new precise_timer);
+  std::uniform_real_distribution <double> uniform;
+  std::exponential_distribution <double>  exponential;
+  unsigned long     current_version = 0;
+  published_version current_categories;
 
   while (!stop_called) {
-    auto scale_read = locked_scale.get_read_auth(auth);
-    assert(scale_read);
-
-    const double category_uniform = uniform(generator);
-    const double time_exponential = exponential(generator) / *scale_read;
-
-    scale_read.clear();
+    const double scale = current_scale;
 
     // NOTE: Category selection comes before sleep, so that the sleep
     // corresponds to the categories available when it starts. This makes the
@@ -363,10 +1032,41 @@ void action_timer <Category> ::thread_loop(unsigned int thread_number) {
     // any change takes effect only after the sleep. It's possible, however, for
     // the action corresponding to the category to change/disappear.
 
+    if (lock_free_sampling) {
+      this->reload_published(current_version, current_categories);
+      // NOTE: Empty timers fall through to the locked path, which waits.
+      if (current_categories && current_categories->get_total_size() != Size()) {
+        const auto &categories = *current_categories;
+        this->start_event(generator, 0);
+        const double       time_exponential = exponential(generator) / scale;
+        const slot_pointer slot = categories.locate(uniform_position(categories.get_total_size(), generator)).slot;
+        const double       time = time_exponential / (double) categories.get_total_size() * (double) thread_count;
+        if (!this->sleep_and_trigger(slot, time, *timer)) {
+          break;
+        }
+        continue;
+      }
+    }
+
+    if (snapshot_sampling) {
+      auto current_snapshot = std::atomic_load(&snapshot);
+      if (current_snapshot) {
+        this->start_event(generator, 0);
+        const double       time_exponential = exponential(generator) / scale;
+        const slot_pointer slot = current_snapshot->locate(uniform(generator) * current_snapshot->get_total_size()).slot;
+        const double       time = time_exponential / current_snapshot->get_total_size() * (double) thread_count;
+        current_snapshot.reset();
+        if (!this->sleep_and_trigger(slot, time, *timer)) {
+          break;
+        }
+        continue;
+      }
+    }
+
     auto category_read = locked_categories.get_read_auth(auth);
     assert(category_read);
 
-    if (category_read->get_total_size() == 0.0) {
+    if (category_read->get_total_size() == Size()) {
       // NOTE: Failing to clear category_read will cause a deadlock!
       category_read.clear();
       // Manually perform the check that get_write_auth would perform if locking
@@ -382,32 +1082,51 @@ void action_timer <Category> ::thread_loop(unsigned int thread_number) {
       continue;
     }
 
-    // NOTE: Need to copy category to avoid a race condition!
-    const Category category = category_read->locate(category_uniform * category_read->get_total_size());
-    const double   time     = time_exponential / category_read->get_total_size() * (double) thread_count;
+    if (snapshot_sampling) {
+      this->rebuild_snapshot(*category_read);
+    }
+
+    // NOTE: The random numbers for an event are only drawn once it's certain
+    // that the event will happen, so that counter-based generators don't skip
+    // event indices.
+    this->start_event(generator, 0);
+    const double time_exponential = exponential(generator) / scale;
+    // NOTE: Need to copy the slot to avoid a race condition! The slot holds the
+    // action, so this is the only lookup needed for the event.
+    const slot_pointer slot = category_read->locate(uniform_position(category_read->get_total_size(), generator)).slot;
+    const double       time = time_exponential / (double) category_read->get_total_size() * (double) thread_count;
     category_read.clear();
     assert(!category_read);
 
-    timer->sleep_for(time, [this] { return (bool) stop_called; });
-    if (stop_called) {
+    if (!this->sleep_and_trigger(slot, time, *timer)) {
       break;
     }
+  }
+}
 
-    auto action_read = locked_actions.get_read_auth(auth);
-    assert(action_read);
-    auto existing = action_read->find(category);
-    bool remove = false;
-    if (existing != action_read->end()) {
-      assert(existing->second);
-      remove = !existing->second->trigger_action();
-    }
-    if (remove) {
-      action_read.clear();
-      assert(!action_read);
-      this->erase_timer(category);
-      this->erase_action(category);
-    }
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool action_timer <Category, Size, Tree, Generator> ::sleep_and_trigger(const slot_pointer &slot, double time,
+                                                 sleep_timer &timer) {
+  assert(slot);
+  timer.sleep_for(time, [this] { return (bool) stop_called; });
+  if (stop_called) {
+    return false;
   }
+  // NOTE: Loading the action after the sleep means that set_action and
+  // erase_action during the sleep still take effect for this event. Rather
+  // than locking, triggering is counted, so that replacing the action can wait
+  // for it to finish. (See wait_for_triggers.)
+  if (!trigger_slot(slot)) {
+    // NOTE: This erases through slot rather than by category, in case the
+    // category was erased and then created again (with a new slot) during the
+    // sleep.
+    const auto find = [&slot](slot_registry &slots) {
+      return slots.by_index[slot->index] == slot? slot : slot_pointer();
+    };
+    this->erase_slot_timer(find);
+    this->erase_slot_action(find);
+  }
+  return true;
 }
 
 #endif //action_timer_hpp
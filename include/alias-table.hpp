@@ -0,0 +1,130 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef alias_table_hpp
+#define alias_table_hpp
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+// An immutable snapshot of a categorical distribution, e.g., a category_tree,
+// that samples in O(1) using Vose's alias method. Building takes O(n).
+// This is only worthwhile when the distribution changes much less often than
+// it's sampled, since any change requires building a new table.
+template <class Category, class Size = double>
+class alias_table {
+public:
+  // Tree can be anything with a category_tree-style for_each. Categories with
+  // zero size are left out.
+  template <class Tree>
+  explicit alias_table(const Tree &tree) : total_size() {
+    std::vector <double> sizes;
+    tree.for_each([this,&sizes](const Category &category, Size size) {
+      if (size != Size()) {
+        categories.push_back(category);
+        sizes.push_back(size);
+        total_size += size;
+      }
+    });
+    this->build_table(sizes);
+  }
+
+  // Same semantics as category_tree::locate, i.e., 0 <= size < total_size;
+  // however, the category for a given size will generally differ from that of
+  // the tree. The distribution of the result is the same for uniform sizes.
+  const Category &locate(Size size) const {
+    assert(!entries.empty() && size >= Size() && size < total_size);
+    const double scaled = (double) size / (double) total_size * entries.size();
+    std::size_t index = scaled;
+    // Protects against rounding up to entries.size().
+    if (index >= entries.size()) {
+      index = entries.size() - 1;
+    }
+    const alias_entry &entry = entries[index];
+    return categories[(scaled - index < entry.threshold)? index : entry.alias];
+  }
+
+  Size get_total_size() const {
+    return total_size;
+  }
+
+  // The number of categories with non-zero size.
+  std::size_t category_count() const {
+    return categories.size();
+  }
+
+private:
+  // Each column of the table is split between its own category (below
+  // threshold) and the alias category (at or above threshold).
+  struct alias_entry {
+    double        threshold;
+    std::uint32_t alias;
+  };
+
+  void build_table(std::vector <double> &sizes) {
+    assert(categories.size() < ~std::uint32_t());
+    entries.resize(sizes.size());
+    std::vector <std::uint32_t> small, large;
+    for (std::size_t i = 0; i < sizes.size(); ++i) {
+      // The average column has size 1.
+      sizes[i] = sizes[i] / (double) total_size * sizes.size();
+      (sizes[i] < 1.0? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+      const std::uint32_t less = small.back(), more = large.back();
+      small.pop_back();
+      entries[less].threshold = sizes[less];
+      entries[less].alias     = more;
+      // NOTE: This is (more + less) - 1, ordered to limit rounding error.
+      sizes[more] = (sizes[more] + sizes[less]) - 1.0;
+      if (sizes[more] < 1.0) {
+        large.pop_back();
+        small.push_back(more);
+      }
+    }
+    // Anything left over is 1.0 up to rounding error.
+    for (std::uint32_t index : small) {
+      entries[index].threshold = 1.0;
+      entries[index].alias     = index;
+    }
+    for (std::uint32_t index : large) {
+      entries[index].threshold = 1.0;
+      entries[index].alias     = index;
+    }
+  }
+
+  std::vector <Category>    categories;
+  std::vector <alias_entry> entries;
+  Size                      total_size;
+};
+
+#endif //alias_table_hpp
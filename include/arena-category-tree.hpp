@@ -0,0 +1,396 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef arena_category_tree_hpp
+#define arena_category_tree_hpp
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <type_traits>
+#include <vector>
+
+// Same interface and semantics as category_tree, but all nodes live in a single
+// contiguous arena and refer to each other with 32-bit indices. Erased nodes go
+// onto a free list and get reused by later inserts, so after the tree has
+// reached its working size, updates never touch the global allocator.
+//
+// To keep nodes small, categories are stored out of line in a parallel array,
+// heights are a single byte, and the per-category sizes can optionally be
+// stored as a smaller Weight type (e.g., float) while the subtree totals still
+// use Size. With <int, double, float>, each category takes 28 bytes. (See
+// the "memory" section of test/category-tree-benchmark.cpp.)
+// NOTE: Category must be copy-assignable, since arena slots get reused. The
+// Category of an erased node isn't destructed until its slot is reused or the
+// tree is destructed.
+template <class Category, class Size = double, class Weight = Size>
+class arena_category_tree {
+public:
+  using index_type = std::uint32_t;
+
+  arena_category_tree() : root(no_node()), free_list(no_node()) {}
+
+  bool category_exists(const Category &category) const {
+    return this->find_node(category) != no_node();
+  }
+
+  Size category_size(const Category &category) const {
+    const index_type found = this->find_node(category);
+    return found == no_node()? Size() : Size(nodes[found].size);
+  }
+
+  // See category_node::locate for the semantics.
+  const Category &locate(Size size) const {
+    assert(root != no_node() && size >= Size() && size < this->get_total_size());
+    index_type current = root;
+    while (true) {
+      const arena_node &node = nodes[current];
+      if (node.low_child != no_node()) {
+        const Size low_size = nodes[node.low_child].total_size;
+        if (size < low_size) {
+          current = node.low_child;
+          continue;
+        }
+        size -= low_size;
+      }
+      if (node.high_child == no_node() || size < Size(node.size)) {
+        assert(node.size != Weight());
+        return keys[current];
+      }
+      size -= Size(node.size);
+      current = node.high_child;
+    }
+  }
+
+  void update_category(const Category &category, Size new_size) {
+    root = this->update_node(root, category, [new_size](Size) { return new_size; });
+  }
+
+  template <class Update,
+            class = typename std::enable_if <!std::is_convertible <Update, Size> ::value> ::type>
+  void update_category(const Category &category, const Update &update) {
+    root = this->update_node(root, category, update);
+  }
+
+  void erase_category(const Category &category) {
+    root = this->erase_node(root, category);
+  }
+
+  Size get_total_size() const {
+    return root == no_node()? Size() : nodes[root].total_size;
+  }
+
+  // Calls visit(category, size) for each category, in category order.
+  template <class Visit>
+  void for_each(const Visit &visit) const {
+    this->for_each_node(root, visit);
+  }
+
+  // Preallocates space for the given number of categories.
+  void reserve(std::size_t count) {
+    nodes.reserve(count);
+  }
+
+  // Reorders the arena so that each node is followed by its low subtree, which
+  // makes descents mostly sequential in memory. This also discards free slots.
+  // Locality slowly degrades with later inserts and rotations, so this is
+  // mainly useful after loading a large tree, and occasionally thereafter.
+  void compact() {
+    std::vector <arena_node> compacted;
+    compacted.reserve(nodes.size());
+    std::vector <Category> compacted_keys;
+    compacted_keys.reserve(keys.size());
+    root = this->copy_preorder(root, compacted, compacted_keys);
+    nodes.swap(compacted);
+    keys.swap(compacted_keys);
+    free_list = no_node();
+  }
+
+  // Bytes currently reserved for nodes and categories, including free slots,
+  // but not including memory owned by the categories themselves.
+  std::size_t arena_bytes() const {
+    return nodes.capacity() * sizeof(arena_node) + keys.capacity() * sizeof(Category);
+  }
+
+private:
+  static constexpr index_type no_node() {
+    return ~index_type();
+  }
+
+  struct arena_node {
+    explicit arena_node(Weight new_size) :
+    total_size(new_size), low_child(no_node()), high_child(no_node()),
+    size(new_size), height(1) {}
+
+    // NOTE: The order minimizes padding when Weight is smaller than Size.
+    Size         total_size;
+    index_type   low_child, high_child;
+    Weight       size;
+    std::uint8_t height;
+  };
+
+  index_type find_node(const Category &category) const {
+    index_type current = root;
+    while (current != no_node()) {
+      if (category == keys[current]) break;
+      current = (category < keys[current])? nodes[current].low_child : nodes[current].high_child;
+    }
+    return current;
+  }
+
+  template <class Visit>
+  void for_each_node(index_type current, const Visit &visit) const {
+    if (current == no_node()) return;
+    this->for_each_node(nodes[current].low_child, visit);
+    visit(keys[current], Size(nodes[current].size));
+    this->for_each_node(nodes[current].high_child, visit);
+  }
+
+  index_type allocate_node(const Category &category, Size size) {
+    if (free_list != no_node()) {
+      const index_type reused = free_list;
+      free_list = nodes[reused].low_child;
+      nodes[reused] = arena_node(size);
+      keys[reused]  = category;
+      return reused;
+    }
+    assert(nodes.size() < no_node());
+    nodes.emplace_back(size);
+    keys.push_back(category);
+    return nodes.size() - 1;
+  }
+
+  index_type copy_preorder(index_type current, std::vector <arena_node> &compacted,
+                           std::vector <Category> &compacted_keys) {
+    if (current == no_node()) {
+      return current;
+    }
+    const index_type copied = compacted.size();
+    compacted.push_back(nodes[current]);
+    compacted_keys.push_back(std::move(keys[current]));
+    const index_type low_child  = this->copy_preorder(nodes[current].low_child,  compacted, compacted_keys);
+    const index_type high_child = this->copy_preorder(nodes[current].high_child, compacted, compacted_keys);
+    compacted[copied].low_child  = low_child;
+    compacted[copied].high_child = high_child;
+    return copied;
+  }
+
+  void release_node(index_type released) {
+    nodes[released].low_child  = free_list;
+    nodes[released].high_child = no_node();
+    free_list = released;
+  }
+
+  // NOTE: Recursive calls can reallocate the arena, so node references must not
+  // be held across them; this is why subtree roots are passed by value and
+  // returned rather than updated through a reference.
+  template <class Update>
+  index_type update_node(index_type current, const Category &category,
+                         const Update &update) {
+    if (current == no_node()) {
+      return this->allocate_node(category, update(Size()));
+    } else if (category == keys[current]) {
+      nodes[current].size = update(Size(nodes[current].size));
+    } else if (category < keys[current]) {
+      const index_type low_child = this->update_node(nodes[current].low_child, category, update);
+      nodes[current].low_child = low_child;
+    } else {
+      const index_type high_child = this->update_node(nodes[current].high_child, category, update);
+      nodes[current].high_child = high_child;
+    }
+    return this->update_and_rebalance(current);
+  }
+
+  index_type erase_node(index_type current, const Category &category) {
+    if (current == no_node()) {
+      return current;
+    }
+    arena_node &node = nodes[current];
+    if (category == keys[current]) {
+      const index_type removed = current;
+      current = this->remove_node(current);
+      this->release_node(removed);
+    } else if (category < keys[current]) {
+      node.low_child = this->erase_node(node.low_child, category);
+    } else {
+      node.high_child = this->erase_node(node.high_child, category);
+    }
+    return this->update_and_rebalance(current);
+  }
+
+  // Returns the subtree that replaces current once current is unlinked.
+  index_type remove_node(index_type current) {
+    arena_node &node = nodes[current];
+    index_type new_parent = no_node();
+    if (this->get_balance(current) < 0) {
+      node.low_child = this->remove_highest_node(node.low_child, new_parent);
+    } else {
+      node.high_child = this->remove_lowest_node(node.high_child, new_parent);
+    }
+    if (new_parent != no_node()) {
+      nodes[new_parent].low_child  = node.low_child;
+      nodes[new_parent].high_child = node.high_child;
+      this->update_node_data(new_parent);
+    }
+    node.low_child = node.high_child = no_node();
+    return new_parent;
+  }
+
+  index_type remove_lowest_node(index_type current, index_type &removed) {
+    if (current == no_node()) {
+      return current;
+    }
+    arena_node &node = nodes[current];
+    if (node.low_child == no_node()) {
+      removed = current;
+      const index_type high_child = node.high_child;
+      node.high_child = no_node();
+      return high_child;
+    }
+    node.low_child = this->remove_lowest_node(node.low_child, removed);
+    return this->update_and_rebalance(current);
+  }
+
+  index_type remove_highest_node(index_type current, index_type &removed) {
+    if (current == no_node()) {
+      return current;
+    }
+    arena_node &node = nodes[current];
+    if (node.high_child == no_node()) {
+      removed = current;
+      const index_type low_child = node.low_child;
+      node.low_child = no_node();
+      return low_child;
+    }
+    node.high_child = this->remove_highest_node(node.high_child, removed);
+    return this->update_and_rebalance(current);
+  }
+
+  int get_height(index_type current) const {
+    return current == no_node()? 0 : nodes[current].height;
+  }
+
+  int get_balance(index_type current) const {
+    return this->get_height(nodes[current].high_child) -
+           this->get_height(nodes[current].low_child);
+  }
+
+  void update_node_data(index_type current) {
+    arena_node &node = nodes[current];
+    node.total_size = Size(node.size);
+    if (node.low_child  != no_node()) node.total_size += nodes[node.low_child].total_size;
+    if (node.high_child != no_node()) node.total_size += nodes[node.high_child].total_size;
+    node.height = std::max(this->get_height(node.low_child),
+                           this->get_height(node.high_child)) + 1;
+  }
+
+  index_type update_and_rebalance(index_type current) {
+    if (current == no_node()) {
+      return current;
+    }
+    this->update_node_data(current);
+    const int balance = this->get_balance(current);
+    if (balance > 1) {
+      return this->pivot_low(current);
+    }
+    if (balance < -1) {
+      return this->pivot_high(current);
+    }
+    return current;
+  }
+
+  index_type pivot_low(index_type current) {
+    assert(nodes[current].high_child != no_node());
+    // Make sure that high_child has non-negative balance.
+    if (this->get_balance(nodes[current].high_child) < 0) {
+      nodes[current].high_child = this->pivot_high(nodes[current].high_child);
+    }
+    const index_type new_parent = nodes[current].high_child;
+    nodes[current].high_child = nodes[new_parent].low_child;
+    nodes[new_parent].low_child = current;
+    this->update_node_data(current);
+    this->update_node_data(new_parent);
+    return new_parent;
+  }
+
+  index_type pivot_high(index_type current) {
+    assert(nodes[current].low_child != no_node());
+    // Make sure that low_child has non-positive balance.
+    if (this->get_balance(nodes[current].low_child) > 0) {
+      nodes[current].low_child = this->pivot_low(nodes[current].low_child);
+    }
+    const index_type new_parent = nodes[current].low_child;
+    nodes[current].low_child = nodes[new_parent].high_child;
+    nodes[new_parent].high_child = current;
+    this->update_node_data(current);
+    this->update_node_data(new_parent);
+    return new_parent;
+  }
+
+  std::vector <arena_node> nodes;
+  // NOTE: keys[i] is the category for nodes[i].
+  std::vector <Category>   keys;
+  index_type root, free_list;
+
+#ifdef TESTING
+  FRIEND_TEST(arena_category_tree_test, integration_test);
+  FRIEND_TEST(arena_category_tree_test, slot_reuse_test);
+  FRIEND_TEST(arena_category_tree_test, compact_weights);
+
+  bool validate_tree() const {
+    std::size_t count = 0;
+    return this->validate_node(root, count) >= 0;
+  }
+
+  // Returns the height of the subtree, or -1 if it's invalid.
+  int validate_node(index_type current, std::size_t &count) const {
+    if (current == no_node()) return 0;
+    if (++count > nodes.size()) return -1;
+    const arena_node &node = nodes[current];
+    if (node.low_child  != no_node() && !(keys[node.low_child] < keys[current])) return -1;
+    if (node.high_child != no_node() && !(keys[current] < keys[node.high_child])) return -1;
+    const int low_height  = this->validate_node(node.low_child,  count);
+    const int high_height = this->validate_node(node.high_child, count);
+    if (low_height < 0 || high_height < 0) return -1;
+    if (std::abs(high_height - low_height) > 1) return -1;
+    if (node.height != std::max(low_height, high_height) + 1) return -1;
+    // NOTE: This must match update_node_data to avoid precision errors!
+    Size actual_size = Size(node.size);
+    if (node.low_child  != no_node()) actual_size += nodes[node.low_child].total_size;
+    if (node.high_child != no_node()) actual_size += nodes[node.high_child].total_size;
+    if (node.total_size != actual_size) return -1;
+    return node.height;
+  }
+#endif
+};
+
+#endif //arena_category_tree_hpp
@@ -0,0 +1,101 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef category_interner_hpp
+#define category_interner_hpp
+
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Assigns dense ids (0, 1, 2, ...) to categories, in the order they're first
+// interned, and maps ids back to categories. This lets expensive categories
+// (e.g., long strings) be compared and copied as integers wherever they're
+// used heavily, with the categories themselves only used at the edges.
+//
+// Ids are never reused, so an id stays valid (and refers to the same category)
+// for as long as the interner exists.
+//
+// NOTE: This isn't thread-safe; see interned_action_timer for a locked use.
+template <class Category, class Id = std::uint32_t>
+class category_interner {
+public:
+  typedef Id id_type;
+
+  category_interner() = default;
+
+  // Not copyable, since categories points into ids.
+  category_interner(const category_interner&) = delete;
+  category_interner &operator = (const category_interner&) = delete;
+
+  // Returns the id for category, assigning the next id if it's new.
+  Id intern(const Category &category) {
+    auto existing = ids.lower_bound(category);
+    if (existing != ids.end() && !(category < existing->first)) {
+      return existing->second;
+    }
+    assert(categories.size() < std::size_t(Id(-1)));
+    const Id id = categories.size();
+    existing = ids.emplace_hint(existing, category, id);
+    categories.push_back(&existing->first);
+    return id;
+  }
+
+  // Returns false if category has never been interned.
+  bool find_id(const Category &category, Id &id) const {
+    const auto existing = ids.find(category);
+    if (existing == ids.end()) {
+      return false;
+    }
+    id = existing->second;
+    return true;
+  }
+
+  // NOTE: It's an error to call this with an id that wasn't returned by intern.
+  const Category &get_category(Id id) const {
+    assert(std::size_t(id) < categories.size());
+    return *categories[id];
+  }
+
+  std::size_t size() const {
+    return categories.size();
+  }
+
+private:
+  // NOTE: Category is already required to be sortable by category_tree, so
+  // this is a map rather than imposing hashability on Category.
+  std::map <Category, Id> ids;
+  // NOTE: categories[id] points to the key in ids, which is never moved.
+  std::vector <const Category*> categories;
+};
+
+#endif //category_interner_hpp
@@ -32,19 +32,135 @@ either expressed or implied, of the FreeBSD Project.
 #ifndef category_tree_hpp
 #define category_tree_hpp
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstddef>
 #include <functional>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <queue>
+#include <random>
 #include <stack>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
-template <class Category, class Size>
+// Augmentations that category_node can cache for each subtree, in addition to
+// total_size, chosen with the Augment parameter of category_tree. Each one has
+// a node_data that's recomputed from the node's size and its children's
+// node_data whenever total_size is, so they cost O(1) per node update and
+// make the corresponding category_tree queries O(log n). Use
+// category_augmentations to combine several.
+
+struct no_augmentation {
+  template <class Size>
+  struct node_data {
+    void update(Size, const node_data*, const node_data*) {}
+  };
+};
+
+// Enables size, nth and rank.
+struct count_augmentation {
+  template <class Size>
+  struct node_data {
+    void update(Size, const node_data *low, const node_data *high) {
+      count = 1 + (low? low->count : 0) + (high? high->count : 0);
+    }
+
+    std::size_t count;
+  };
+};
+
+// Enables max_category and top_categories.
+struct max_size_augmentation {
+  template <class Size>
+  struct node_data {
+    void update(Size size, const node_data *low, const node_data *high) {
+      max_size = size;
+      if (low  && max_size < low->max_size)  max_size = low->max_size;
+      if (high && max_size < high->max_size) max_size = high->max_size;
+    }
+
+    Size max_size;
+  };
+};
+
+// Enables min_category.
+struct min_size_augmentation {
+  template <class Size>
+  struct node_data {
+    void update(Size size, const node_data *low, const node_data *high) {
+      min_size = size;
+      if (low  && low->min_size  < min_size) min_size = low->min_size;
+      if (high && high->min_size < min_size) min_size = high->min_size;
+    }
+
+    Size min_size;
+  };
+};
+
+template <class... Augmentations>
+struct category_augmentations {
+  template <class Size>
+  struct node_data : public Augmentations::template node_data <Size>... {
+    void update(Size size, const node_data *low, const node_data *high) {
+      const int expand[] = { 0, (Augmentations::template node_data <Size> ::update(size, low, high), 0)... };
+      (void) expand;
+    }
+  };
+};
+
+template <class Category, class Size, class Augment = no_augmentation>
 class category_node;
 
-template <class Category, class Size = double>
+template <class Size, class Generator>
+Size uniform_position(Size total_size, Generator &generator, std::true_type) {
+  return std::uniform_int_distribution <Size> (Size(), total_size - 1)(generator);
+}
+
+template <class Size, class Generator>
+Size uniform_position(Size total_size, Generator &generator, std::false_type) {
+  const Size position = std::uniform_real_distribution <Size> ()(generator) * total_size;
+  // The product can round up to total_size.
+  return (position < total_size)? position : std::nextafter(total_size, Size());
+}
+
+// Returns a uniformly-distributed position in [0, total_size), for use with
+// locate in any of the trees. For integral Size the position is drawn directly
+// from the integers, which makes sampling exact; otherwise, it's uniform * total.
+template <class Size, class Generator>
+Size uniform_position(Size total_size, Generator &generator) {
+  assert(total_size > Size());
+  return uniform_position(total_size, generator, std::is_integral <Size> ());
+}
+
+template <class Category, class Size = double, class Augment = no_augmentation>
 class category_tree {
 public:
-  using node_type = category_node <Category, Size>;
+  using node_type = category_node <Category, Size, Augment>;
+
+  category_tree() = default;
+
+  // See assign.
+  template <class Iterator>
+  category_tree(Iterator begin, Iterator end) {
+    this->assign(begin, end);
+  }
+
+  // Replaces the contents of the tree with the (Category, Size) pairs in
+  // [begin, end), e.g., from a std::map or a vector of std::pair. The tree is
+  // built bottom-up, perfectly balanced, in O(n) time if the range is random-
+  // access and sorted by category; otherwise, it's first copied (and sorted if
+  // needed). If a category is repeated, the last size wins, as it would with
+  // update_category.
+  template <class Iterator>
+  void assign(Iterator begin, Iterator end) {
+    this->assign(begin, end, typename std::iterator_traits <Iterator> ::iterator_category());
+  }
 
   bool category_exists(const Category &category) const {
     return root && root->category_exists(category);
@@ -59,12 +175,108 @@ public:
     return root->locate(size);
   }
 
+  // Returns a uniformly-distributed position in [0, get_total_size()) for use
+  // with locate.
+  template <class Generator>
+  Size uniform_position(Generator &generator) const {
+    return ::uniform_position(this->get_total_size(), generator);
+  }
+
+  // Samples up to count distinct categories, writing them to output in the
+  // order they're drawn, and returns the updated output. Each draw chooses a
+  // category with probability proportional to its size among the categories
+  // not already drawn; i.e., weighted sampling without replacement. Fewer than
+  // count are written if there aren't enough categories with nonzero size. The
+  // tree isn't modified: the sizes of drawn categories are subtracted in a
+  // temporary overlay, which makes this O(count log n).
+  template <class Generator, class Output>
+  Output sample_distinct(std::size_t count, Generator &generator, Output output) const {
+    return root? root->sample_distinct(count, generator, output) : output;
+  }
+
+  // Writes all of the categories with nonzero size to output in a random order
+  // in which each category is chosen with probability proportional to its size
+  // among those remaining. (See sample_distinct.)
+  template <class Generator, class Output>
+  Output weighted_permutation(Generator &generator, Output output) const {
+    return this->sample_distinct(std::numeric_limits <std::size_t> ::max(), generator, output);
+  }
+
+  // The total size of the categories in [low, high). This is O(log n), using
+  // the totals of the subtrees that are entirely within the range. (For
+  // string categories with a common prefix, e.g., "tenant/", the range
+  // ["tenant/", "tenant0") contains exactly the categories with that prefix.)
+  Size total_size_in_range(const Category &low, const Category &high) const {
+    return root? root->total_size_in_range(low, high) : Size();
+  }
+
+  // Same as locate, but only for the categories in [low, high); i.e., the
+  // assumption is that 0 <= size < total_size_in_range(low, high). This is
+  // also O(log n).
+  const Category &locate_in_range(const Category &low, const Category &high, Size size) const {
+    assert(root && size >= Size());
+    return root->locate_in_range(low, high, size);
+  }
+
+  // Locates every position in [begin, end), writing the categories to output
+  // in the same order as the positions, and returns the updated output.
+  // Sorted positions are resolved in a single in-order traversal that visits
+  // each node at most once, so the upper levels of the tree are shared by all
+  // of the positions. Unsorted positions are sorted internally first. (Sorted
+  // uniform draws can be generated directly in linear time by normalizing the
+  // cumulative sum of n+1 exponential draws.)
+  // NOTE: Iterator must be a forward iterator.
+  template <class Iterator, class Output>
+  Output locate_many(Iterator begin, Iterator end, Output output) const {
+    if (begin == end) {
+      return output;
+    }
+    assert(root);
+    if (std::is_sorted(begin, end)) {
+      assert(*begin >= Size());
+      root->locate_many(begin, end, Size(), [&output](const Category &category) {
+        *output = category;
+        ++output;
+      });
+      return output;
+    }
+    std::vector <Size> positions(begin, end);
+    std::vector <std::size_t> order(positions.size());
+    for (std::size_t i = 0; i < order.size(); ++i) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(),
+              [&positions](std::size_t left, std::size_t right) {
+                return positions[left] < positions[right];
+              });
+    std::vector <Size> sorted_positions;
+    sorted_positions.reserve(positions.size());
+    for (std::size_t index : order) {
+      sorted_positions.push_back(positions[index]);
+    }
+    assert(sorted_positions.front() >= Size());
+    std::vector <const Category*> located(positions.size());
+    auto next_index = order.begin();
+    root->locate_many(sorted_positions.begin(), sorted_positions.end(), Size(),
+                      [&located, &next_index](const Category &category) {
+                        located[*next_index++] = &category;
+                      });
+    for (const Category *category : located) {
+      *output = *category;
+      ++output;
+    }
+    return output;
+  }
+
   void update_category(const Category &category, Size new_size) {
     node_type::update_category(root, category, new_size);
   }
 
-  void update_category(const Category &category,
-                       const std::function <Size(Size)> &update) {
+  // update is any callable that maps the old size to the new size. (The old
+  // size of a new category is Size().)
+  template <class Update,
+            class = typename std::enable_if <!std::is_convertible <Update, Size> ::value> ::type>
+  void update_category(const Category &category, const Update &update) {
     node_type::update_category(root, category, update);
   }
 
@@ -72,49 +284,470 @@ public:
     node_type::erase_category(root, category);
   }
 
+  // Applies a batch of (Category, Size) pairs as if update_category were called
+  // for each, in order. Batches that are large relative to the tree are merged
+  // with the existing categories in a single O(n + k) pass that rebuilds the
+  // tree; smaller batches are applied one at a time in O(k log n).
+  template <class Iterator>
+  void update_categories(Iterator begin, Iterator end) {
+    std::vector <std::pair <Category, Size>> updates(begin, end);
+    if (!this->merge_pays_off(updates.size())) {
+      for (const auto &update : updates) {
+        this->update_category(update.first, update.second);
+      }
+      return;
+    }
+    sort_categories(updates);
+    std::vector <std::pair <Category, Size>> merged;
+    auto next_update = updates.begin();
+    this->for_each([&merged,&next_update,&updates](const Category &category, Size size) {
+      while (next_update != updates.end() && next_update->first < category) {
+        merged.push_back(std::move(*next_update++));
+      }
+      if (next_update != updates.end() && next_update->first == category) {
+        merged.push_back(std::move(*next_update++));
+      } else {
+        merged.emplace_back(category, size);
+      }
+    });
+    std::move(next_update, updates.end(), std::back_inserter(merged));
+    root = node_type::build_balanced(merged.begin(), merged.end());
+  }
+
+  // Erases every category in [begin, end). See update_categories.
+  template <class Iterator>
+  void erase_categories(Iterator begin, Iterator end) {
+    std::vector <Category> erased(begin, end);
+    if (!this->merge_pays_off(erased.size())) {
+      for (const Category &category : erased) {
+        this->erase_category(category);
+      }
+      return;
+    }
+    std::sort(erased.begin(), erased.end());
+    std::vector <std::pair <Category, Size>> remaining;
+    auto next_erased = erased.begin();
+    this->for_each([&remaining,&next_erased,&erased](const Category &category, Size size) {
+      while (next_erased != erased.end() && *next_erased < category) {
+        ++next_erased;
+      }
+      if (next_erased == erased.end() || !(*next_erased == category)) {
+        remaining.emplace_back(category, size);
+      }
+    });
+    root = node_type::build_balanced(remaining.begin(), remaining.end());
+  }
+
   Size get_total_size() const {
     return root? root->get_total_size() : Size();
   }
 
+  // Calls visit(category, size) for each category, in category order.
+  template <class Visit>
+  void for_each(const Visit &visit) const {
+    if (root) root->for_each(visit);
+  }
+
+  // Iteration over the nodes in category order. Use get_category and get_size
+  // to access the contents of each node.
+  // NOTE: Any modification of the tree invalidates all iterators.
+  using const_iterator = typename node_type::const_iterator;
+
+  const_iterator begin() const {
+    return const_iterator::first(root.get());
+  }
+
+  const_iterator end() const {
+    return const_iterator();
+  }
+
+  const_iterator lower_bound(const Category &category) const {
+    return const_iterator::lower_bound(root.get(), category);
+  }
+
+  const_iterator upper_bound(const Category &category) const {
+    return const_iterator::upper_bound(root.get(), category);
+  }
+
+  // Copies (Category, Size) pairs into buffer, in category order starting at
+  // start, until either capacity pairs have been copied or the end of the tree
+  // is reached. Returns the number of pairs copied. To export a large tree in
+  // chunks, e.g., to avoid holding a lock for the whole export, start each
+  // chunk at upper_bound of the last category copied.
+  std::size_t export_categories(const_iterator start, std::pair <Category, Size> *buffer,
+                                std::size_t capacity) const {
+    std::size_t copied = 0;
+    for (; copied < capacity && start != this->end(); ++start, ++copied) {
+      buffer[copied].first  = start->get_category();
+      buffer[copied].second = start->get_size();
+    }
+    return copied;
+  }
+
+  std::size_t export_categories(std::pair <Category, Size> *buffer, std::size_t capacity) const {
+    return this->export_categories(this->begin(), buffer, capacity);
+  }
+
+  // Moves every category that isn't less than category into a new tree, which
+  // is returned. This is O(log n), and total sizes stay correct in both trees,
+  // since the totals of any subtree that's moved intact are still valid.
+  category_tree split(const Category &category) {
+    category_tree high;
+    typename node_type::optional_node low;
+    node_type::split(std::move(root), category, low, high.root);
+    root = std::move(low);
+    return high;
+  }
+
+  // Moves every category from other into this tree, leaving other empty. The
+  // categories in other must either all be greater than or all be less than
+  // the categories in this tree, e.g., if other came from split. This is
+  // O(log n).
+  void join(category_tree &other) {
+    if (!root || !other.root ||
+        root->highest_node().get_category() < other.root->lowest_node().get_category()) {
+      root = node_type::join(std::move(root), std::move(other.root));
+    } else {
+      assert(other.root->highest_node().get_category() < root->lowest_node().get_category());
+      root = node_type::join(std::move(other.root), std::move(root));
+    }
+  }
+
+  // Moves the categories in [low, high) into a new tree, which is returned.
+  // This is O(log n), e.g., for moving a range of categories to another tree
+  // with join, or for erasing a range of categories by discarding the result.
+  // (Destroying the discarded tree is still O(k) for k categories.)
+  category_tree extract_range(const Category &low, const Category &high) {
+    if (!(low < high)) {
+      return category_tree();
+    }
+    category_tree middle = this->split(low);
+    category_tree upper  = middle.split(high);
+    this->join(upper);
+    return middle;
+  }
+
+  // The number of categories. Requires count_augmentation.
+  std::size_t size() const {
+    return root? root->get_count() : 0;
+  }
+
+  // The category at index in category order, e.g., for choosing a category
+  // uniformly regardless of size. Requires count_augmentation.
+  const Category &nth(std::size_t index) const {
+    assert(index < this->size());
+    return root->nth(index);
+  }
+
+  // The number of categories less than category, whether or not category
+  // exists. Requires count_augmentation.
+  std::size_t rank(const Category &category) const {
+    return root? root->rank(category) : 0;
+  }
+
+  // The category with the largest size. Requires max_size_augmentation.
+  const Category &max_category() const {
+    assert(root);
+    return root->max_category();
+  }
+
+  // The category with the smallest size. Requires min_size_augmentation.
+  const Category &min_category() const {
+    assert(root);
+    return root->min_category();
+  }
+
+  // Writes (Category, Size) pairs for the count largest categories to output,
+  // largest first, and returns the updated output. This is O(count log n).
+  // Requires max_size_augmentation.
+  template <class Output>
+  Output top_categories(std::size_t count, Output output) const {
+    return root? root->top_categories(count, output) : output;
+  }
+
 private:
+  template <class Iterator>
+  static bool sorted_and_unique(Iterator begin, Iterator end) {
+    using value_type = typename std::iterator_traits <Iterator> ::value_type;
+    return std::adjacent_find(begin, end,
+                              [](const value_type &left, const value_type &right) {
+                                return !(left.first < right.first);
+                              }) == end;
+  }
+
+  template <class Iterator>
+  void assign(Iterator begin, Iterator end, std::random_access_iterator_tag) {
+    if (sorted_and_unique(begin, end)) {
+      root = node_type::build_balanced(begin, end);
+    } else {
+      this->assign(begin, end, std::input_iterator_tag());
+    }
+  }
+
+  template <class Iterator>
+  void assign(Iterator begin, Iterator end, std::input_iterator_tag) {
+    std::vector <std::pair <Category, Size>> sorted(begin, end);
+    sort_categories(sorted);
+    root = node_type::build_balanced(sorted.begin(), sorted.end());
+  }
+
+  // Sorts by category, keeping only the last of any repeated category.
+  static void sort_categories(std::vector <std::pair <Category, Size>> &pairs) {
+    if (sorted_and_unique(pairs.begin(), pairs.end())) {
+      return;
+    }
+    std::stable_sort(pairs.begin(), pairs.end(),
+                     [](const std::pair <Category, Size> &left,
+                        const std::pair <Category, Size> &right) {
+                       return left.first < right.first;
+                     });
+    auto last = pairs.begin();
+    for (auto current = pairs.begin(); current != pairs.end(); ++current) {
+      if (current + 1 == pairs.end() || current->first < (current + 1)->first) {
+        if (last != current) *last = std::move(*current);
+        ++last;
+      }
+    }
+    pairs.erase(last, pairs.end());
+  }
+
+  // Rebuilding is O(n) whereas individual updates are O(k log n). An AVL tree
+  // of height h has at most 2^h - 1 nodes, which is close enough to n here.
+  bool merge_pays_off(std::size_t batch_size) const {
+    if (!root) return batch_size > 1;
+    const int height = root->get_height();
+    return (double) batch_size * height >= std::ldexp(1.0, height - 1);
+  }
+
   typename node_type::optional_node root;
 
 #ifdef TESTING
   FRIEND_TEST(category_tree_test, integration_test);
   FRIEND_TEST(category_tree_test, zero_size_test);
+  FRIEND_TEST(category_tree_test, assign_sorted);
+  FRIEND_TEST(category_tree_test, assign_unsorted);
+  FRIEND_TEST(category_tree_test, update_categories_batch);
+  FRIEND_TEST(category_tree_test, erase_categories_batch);
+  FRIEND_TEST(category_tree_test, integer_sizes_exact);
+  FRIEND_TEST(category_tree_test, split_and_join);
 #endif
 };
 
-template <class Category, class Size>
-class category_node {
+template <class Category, class Size, class Augment>
+class category_node : private Augment::template node_data <Size> {
 public:
   using optional_node = std::unique_ptr <category_node>;
 
+  class const_iterator;
+
   category_node(const Category &new_category, Size new_size) :
   category(new_category), size(new_size), height(1), total_size() {}
 
+  const Category &get_category() const {
+    return category;
+  }
+
+  Size get_size() const {
+    return size;
+  }
+
   Size get_total_size() const {
     return total_size;
   }
 
-  bool category_exists(const Category &check_category) const {
-    if (check_category == category) return true;
-    if (check_category < category) {
-      return low_child?  low_child->category_exists(check_category)  : false;
-    } else {
-      return high_child? high_child->category_exists(check_category) : false;
+  int get_height() const {
+    return height;
+  }
+
+  std::size_t get_count() const {
+    return this->count;
+  }
+
+  template <class Generator, class Output>
+  Output sample_distinct(std::size_t count, Generator &generator, Output output) const {
+    // Total size removed from each subtree by categories already drawn.
+    std::unordered_map <const category_node*, Size> removed;
+    std::unordered_set <const category_node*> drawn;
+    const auto remaining_size = [&removed](const category_node *node) {
+      const auto found = removed.find(node);
+      return (found == removed.end())? node->total_size : node->total_size - found->second;
+    };
+    // Precision errors in the remaining sizes can lead the search to a category
+    // that has already been drawn, in which case the draw is repeated. The
+    // limit is per draw; reaching it means that the residue has swamped the
+    // remaining sizes, so the rest are drawn from a tree rebuilt from the
+    // categories not drawn yet, which has exact totals.
+    int retries = 0;
+    const category_node *path[max_height];
+    while (count > 0) {
+      const Size remaining_total = remaining_size(this);
+      if (!(Size() < remaining_total)) break;
+      Size check_size = uniform_position(remaining_total, generator);
+      const category_node *current = this;
+      int depth = 0;
+      while (true) {
+        assert(depth < max_height);
+        path[depth++] = current;
+        const category_node *const low = current->low_child.get();
+        if (low) {
+          const Size low_size = remaining_size(low);
+          if (check_size < low_size) {
+            current = low;
+            continue;
+          }
+          check_size -= low_size;
+        }
+        const Size own_size = drawn.count(current)? Size() : current->size;
+        if (!current->high_child || check_size < own_size) break;
+        check_size -= own_size;
+        current = current->high_child.get();
+      }
+      if (current->size == Size() || !drawn.insert(current).second) {
+        if (++retries > max_sample_retries) {
+          std::vector <std::pair <Category, Size>> undrawn;
+          this->collect_undrawn(drawn, undrawn);
+          const optional_node rebuilt = build_balanced(undrawn.begin(), undrawn.end());
+          return rebuilt? rebuilt->sample_distinct(count, generator, output) : output;
+        }
+        continue;
+      }
+      retries = 0;
+      for (int i = 0; i < depth; ++i) {
+        removed[path[i]] += current->size;
+      }
+      *output++ = current->category;
+      --count;
     }
-    return false;
+    return output;
   }
 
-  Size category_size(const Category &check_category) const {
-    if (check_category == category) return size;
-    if (check_category < category) {
-      return low_child?  low_child->category_size(check_category)  : Size();
-    } else {
-      return high_child? high_child->category_size(check_category) : Size();
+  Size total_size_in_range(const Category &low, const Category &high) const {
+    range_piece pieces[max_range_pieces];
+    const int piece_count = this->collect_range(low, high, pieces);
+    Size total = Size();
+    for (int i = 0; i < piece_count; ++i) {
+      total += pieces[i].get_size();
+    }
+    return total;
+  }
+
+  const Category &locate_in_range(const Category &low, const Category &high,
+                                  Size check_size) const {
+    range_piece pieces[max_range_pieces];
+    const int piece_count = this->collect_range(low, high, pieces);
+    assert(piece_count > 0);
+    int last_nonzero = -1;
+    for (int i = 0; i < piece_count; ++i) {
+      const Size piece_size = pieces[i].get_size();
+      if (piece_size == Size()) continue;
+      if (check_size < piece_size) {
+        return pieces[i].whole? pieces[i].node->locate(check_size) : pieces[i].node->category;
+      }
+      check_size -= piece_size;
+      last_nonzero = i;
+    }
+    // Precision error; use the end of the last nonzero piece. (See locate.)
+    assert(last_nonzero >= 0);
+    const range_piece &last = pieces[last_nonzero];
+    return last.whole? last.node->locate(last.get_size()) : last.node->category;
+  }
+
+  const Category &nth(std::size_t index) const {
+    const category_node *current = this;
+    while (true) {
+      const std::size_t low_count = current->low_child? current->low_child->count : 0;
+      if (index < low_count) {
+        current = current->low_child.get();
+      } else if (index == low_count) {
+        return current->category;
+      } else {
+        index -= low_count + 1;
+        current = current->high_child.get();
+        assert(current);
+      }
+    }
+  }
+
+  std::size_t rank(const Category &check_category) const {
+    std::size_t lower = 0;
+    const category_node *current = this;
+    while (current) {
+      if (current->category < check_category) {
+        lower += 1 + (current->low_child? current->low_child->count : 0);
+        current = current->high_child.get();
+      } else {
+        current = current->low_child.get();
+      }
+    }
+    return lower;
+  }
+
+  const Category &max_category() const {
+    const category_node *current = this;
+    while (current->size < current->max_size) {
+      const category_node *const low = current->low_child.get();
+      current = (low && !(low->max_size < current->max_size))? low : current->high_child.get();
+      assert(current);
+    }
+    return current->category;
+  }
+
+  const Category &min_category() const {
+    const category_node *current = this;
+    while (current->min_size < current->size) {
+      const category_node *const low = current->low_child.get();
+      current = (low && !(current->min_size < low->min_size))? low : current->high_child.get();
+      assert(current);
+    }
+    return current->category;
+  }
+
+  // Best-first search using the cached maximum of each subtree. Each subtree
+  // is queued under its maximum, and each node under its own size once its
+  // subtree is expanded.
+  template <class Output>
+  Output top_categories(std::size_t count, Output output) const {
+    struct queued {
+      bool operator < (const queued &other) const { return key < other.key; }
+      Size key;
+      const category_node *node;
+      bool expanded;
+    };
+    std::priority_queue <queued> pending;
+    pending.push(queued{ this->max_size, this, false });
+    while (count > 0 && !pending.empty()) {
+      const queued next = pending.top();
+      pending.pop();
+      if (next.expanded) {
+        *output++ = std::make_pair(next.node->category, next.node->size);
+        --count;
+      } else {
+        pending.push(queued{ next.node->size, next.node, true });
+        if (next.node->low_child) {
+          pending.push(queued{ next.node->low_child->max_size, next.node->low_child.get(), false });
+        }
+        if (next.node->high_child) {
+          pending.push(queued{ next.node->high_child->max_size, next.node->high_child.get(), false });
+        }
+      }
     }
-    return Size();
+    return output;
+  }
+
+  template <class Visit>
+  void for_each(const Visit &visit) const {
+    if (low_child) low_child->for_each(visit);
+    visit(category, size);
+    if (high_child) high_child->for_each(visit);
+  }
+
+  bool category_exists(const Category &check_category) const {
+    return this->find_node(check_category) != nullptr;
+  }
+
+  Size category_size(const Category &check_category) const {
+    const category_node *const found = this->find_node(check_category);
+    return found? found->size : Size();
   }
 
   // The assumption is that 0 <= size < total_size, but it isn't enforced, due
@@ -122,72 +755,280 @@ public:
   // that the upper end is open, which allows this to work as expected with
   // integer size types.
   const Category &locate(Size check_size) const {
-    // Interval is divided into three parts: low, self, high.
-    if (low_child && check_size < low_child->total_size) {
-      return low_child->locate(check_size);
-    }
-    // Not in first part => move to second.
-    if (low_child) check_size -= low_child->total_size;
-    // NOTE: Checking high_child prevents problems below if there is a precision
-    // error that makes check_size >= size.
-    if (!high_child || check_size < size) {
+    const category_node *current = this;
+    while (true) {
+      // Interval is divided into three parts: low, self, high.
+      const category_node *const low = current->low_child.get();
+      if (low && check_size < low->total_size) {
+        current = low;
+        continue;
+      }
+      // Not in first part => move to second.
+      if (low) check_size -= low->total_size;
+      // NOTE: Checking high_child prevents problems below if there is a
+      // precision error that makes check_size >= size.
+      if (!current->high_child || check_size < current->size) {
+        // If this category has zero size, the search should never get here.
+        assert(current->size != Size());
+        return current->category;
+      }
+      // Not in second part => move to third.
+      check_size -= current->size;
+      current = current->high_child.get();
+    }
+  }
+
+  // Passes the category for each position in the sorted range [begin, end) to
+  // visit, in order. offset is the total size of all categories preceding this
+  // subtree, i.e., positions are relative to the entire tree. Like locate, this
+  // doesn't enforce that the positions are within the subtree.
+  template <class Iterator, class Visit>
+  void locate_many(Iterator begin, Iterator end, Size offset, const Visit &visit) const {
+    if (low_child) {
+      const Size low_limit = offset + low_child->total_size;
+      const Iterator low_end = std::lower_bound(begin, end, low_limit);
+      if (begin != low_end) {
+        low_child->locate_many(begin, low_end, offset, visit);
+      }
+      begin  = low_end;
+      offset = low_limit;
+    }
+    // NOTE: Without high_child, everything left belongs to this category, for
+    // the same reason as in locate.
+    const Size self_limit = offset + size;
+    const Iterator self_end = high_child? std::lower_bound(begin, end, self_limit) : end;
+    for (; begin != self_end; ++begin) {
       // If this category has zero size, the search should never get here.
       assert(size != Size());
-      return category;
+      visit(category);
+    }
+    if (begin != end) {
+      high_child->locate_many(begin, end, self_limit, visit);
     }
-    // Not in second part => move to third.
-    check_size -= size;
-    return high_child->locate(check_size);
   }
 
-  static void update_category(optional_node &current, const Category &new_category,
-                              Size new_size) {
-    if (!current) {
-      current.reset(new category_node(new_category, new_size));
-    } else if (current->category == new_category) {
-      current->size = new_size;
-    } else if (new_category < current->category) {
-      update_category(current->low_child, new_category, new_size);
-    } else {
-      update_category(current->high_child, new_category, new_size);
+  // Appends the categories with nonzero size that aren't in drawn, in order.
+  void collect_undrawn(const std::unordered_set <const category_node*> &drawn,
+                       std::vector <std::pair <Category, Size>> &undrawn) const {
+    if (low_child) low_child->collect_undrawn(drawn, undrawn);
+    if (size != Size() && !drawn.count(this)) {
+      undrawn.emplace_back(category, size);
     }
-    update_and_rebalance(current);
+    if (high_child) high_child->collect_undrawn(drawn, undrawn);
+  }
+
+  // Builds a perfectly-balanced tree from sorted, unique (Category, Size) pairs
+  // in the random-access range [begin, end).
+  template <class Iterator>
+  static optional_node build_balanced(Iterator begin, Iterator end) {
+    if (begin == end) {
+      return optional_node();
+    }
+    const Iterator middle = begin + (end - begin) / 2;
+    optional_node current(new category_node(middle->first, middle->second));
+    current->low_child  = build_balanced(begin, middle);
+    current->high_child = build_balanced(middle + 1, end);
+    current->update_size();
+    current->update_height();
+    return current;
   }
 
-  static void update_category(optional_node &current, const Category &new_category,
-                              const std::function <Size(Size)> &update) {
-    assert(update);
-    if (!current) {
-      current.reset(new category_node(new_category, update(Size())));
-    } else if (current->category == new_category) {
-      current->size = update(current->size);
-    } else if (new_category < current->category) {
-      update_category(current->low_child, new_category, update);
+  static void update_category(optional_node &root, const Category &new_category,
+                              Size new_size) {
+    update_category(root, new_category, [new_size](Size) { return new_size; });
+  }
+
+  template <class Update,
+            class = typename std::enable_if <!std::is_convertible <Update, Size> ::value> ::type>
+  static void update_category(optional_node &root, const Category &new_category,
+                              const Update &update) {
+    optional_node *path[max_height];
+    int depth = 0;
+    optional_node *current = &root;
+    while (*current && !((*current)->category == new_category)) {
+      assert(depth < max_height);
+      path[depth++] = current;
+      current = (new_category < (*current)->category)?
+        &(*current)->low_child : &(*current)->high_child;
+    }
+    if (*current) {
+      (*current)->size = update((*current)->size);
     } else {
-      update_category(current->high_child, new_category, update);
+      current->reset(new category_node(new_category, update(Size())));
     }
-    update_and_rebalance(current);
+    update_and_rebalance(*current);
+    rebalance_path(path, depth);
   }
 
-  static void erase_category(optional_node &current, const Category &new_category) {
+  static void erase_category(optional_node &root, const Category &new_category) {
+    optional_node *path[max_height];
+    int depth = 0;
+    optional_node *current = &root;
+    while (*current && !((*current)->category == new_category)) {
+      assert(depth < max_height);
+      path[depth++] = current;
+      current = (new_category < (*current)->category)?
+        &(*current)->low_child : &(*current)->high_child;
+    }
+    if (!*current) {
+      return;
+    }
     optional_node discard;
-    if (!current) {
+    remove_node(*current, discard);
+    update_and_rebalance(*current);
+    rebalance_path(path, depth);
+  }
+
+  // Joins two trees, where every category in low is less than every category
+  // in high. This is O(|height(low) - height(high)| + log n).
+  static optional_node join(optional_node low, optional_node high) {
+    if (!low)  return high;
+    if (!high) return low;
+    optional_node middle;
+    remove_lowest_node(high, middle);
+    return join(std::move(low), std::move(middle), std::move(high));
+  }
+
+  // Splits root into the categories less than split_category (low) and the
+  // rest (high). This is O(log n), since each level joins trees whose heights
+  // differ by about the same amount as the levels already passed.
+  static void split(optional_node root, const Category &split_category,
+                    optional_node &low, optional_node &high) {
+    if (!root) {
+      low.reset();
+      high.reset();
       return;
-    } else if (current->category == new_category) {
-      remove_node(current, discard);
-    } else if (new_category < current->category) {
-      erase_category(current->low_child, new_category);
+    }
+    optional_node low_child, high_child;
+    low_child.swap(root->low_child);
+    high_child.swap(root->high_child);
+    if (root->category < split_category) {
+      optional_node high_low;
+      split(std::move(high_child), split_category, high_low, high);
+      low = join(std::move(low_child), std::move(root), std::move(high_low));
     } else {
-      erase_category(current->high_child, new_category);
+      optional_node low_high;
+      split(std::move(low_child), split_category, low, low_high);
+      high = join(std::move(low_high), std::move(root), std::move(high_child));
     }
-    update_and_rebalance(current);
+  }
+
+  const category_node &lowest_node() const {
+    const category_node *current = this;
+    while (current->low_child) current = current->low_child.get();
+    return *current;
+  }
+
+  const category_node &highest_node() const {
+    const category_node *current = this;
+    while (current->high_child) current = current->high_child.get();
+    return *current;
   }
 
 private:
+  // Joins low and high using middle, which must have no children, and must be
+  // between every category in low and every category in high. This descends
+  // the taller tree to a subtree of about the same height as the other, then
+  // rebalances on the way back up, like an insertion.
+  static optional_node join(optional_node low, optional_node middle, optional_node high) {
+    assert(middle && !middle->low_child && !middle->high_child);
+    const int low_height  = low?  low->height  : 0;
+    const int high_height = high? high->height : 0;
+    if (low_height > high_height + 1) {
+      low->high_child = join(std::move(low->high_child), std::move(middle), std::move(high));
+      update_and_rebalance(low);
+      return low;
+    } else if (high_height > low_height + 1) {
+      high->low_child = join(std::move(low), std::move(middle), std::move(high->low_child));
+      update_and_rebalance(high);
+      return high;
+    } else {
+      middle->low_child  = std::move(low);
+      middle->high_child = std::move(high);
+      middle->update_size();
+      middle->update_height();
+      return middle;
+    }
+  }
+
+  // This bounds the depth of the explicit stacks used in place of recursion.
+  // An AVL tree with n nodes has height < 1.45 log2(n + 2), and a tree can't
+  // have more than 2^59 nodes (i.e., 64-bit address space / 32 bytes).
+  static constexpr int max_height = 96;
+
+  static constexpr int max_sample_retries = 64;
+
+  // Part of a range of categories: either a single node or a whole subtree.
+  struct range_piece {
+    Size get_size() const {
+      return whole? node->total_size : node->size;
+    }
+
+    const category_node *node;
+    bool whole;
+  };
+
+  // Two pieces per level for each side of the range, plus the top node.
+  static constexpr int max_range_pieces = 4 * max_height + 1;
+
+  // Splits [low, high) into disjoint pieces, in category order, and returns the
+  // number of pieces.
+  int collect_range(const Category &low, const Category &high, range_piece *pieces) const {
+    const category_node *top = this;
+    while (top && (top->category < low || !(top->category < high))) {
+      top = (top->category < low)? top->high_child.get() : top->low_child.get();
+    }
+    if (!top) return 0;
+    int count = 0;
+    // Pieces on the low side are found from the highest down.
+    for (const category_node *current = top->low_child.get(); current;) {
+      if (current->category < low) {
+        current = current->high_child.get();
+      } else {
+        if (current->high_child) pieces[count++] = range_piece{ current->high_child.get(), true };
+        pieces[count++] = range_piece{ current, false };
+        current = current->low_child.get();
+      }
+    }
+    std::reverse(pieces, pieces + count);
+    pieces[count++] = range_piece{ top, false };
+    for (const category_node *current = top->high_child.get(); current;) {
+      if (current->category < high) {
+        if (current->low_child) pieces[count++] = range_piece{ current->low_child.get(), true };
+        pieces[count++] = range_piece{ current, false };
+        current = current->high_child.get();
+      } else {
+        current = current->low_child.get();
+      }
+    }
+    assert(count <= max_range_pieces);
+    return count;
+  }
+
+  const category_node *find_node(const Category &check_category) const {
+    const category_node *current = this;
+    while (current && !(check_category == current->category)) {
+      current = (check_category < current->category)?
+        current->low_child.get() : current->high_child.get();
+    }
+    return current;
+  }
+
+  // Updates the nodes on a path recorded during a descent, from the bottom up.
+  static void rebalance_path(optional_node **path, int depth) {
+    while (depth > 0) {
+      update_and_rebalance(*path[--depth]);
+    }
+  }
+
+  // NOTE: total_size is always recomputed from the children, never adjusted,
+  // so rounding error doesn't accumulate across updates. (See
+  // compensated-size.hpp for the bound, and for a more accurate Size.)
   void update_size() {
     total_size = size;
     if (low_child)  total_size += low_child->total_size;
     if (high_child) total_size += high_child->total_size;
+    this->augment_data::update(size, low_child.get(), high_child.get());
   }
 
   void update_height() {
@@ -285,38 +1126,50 @@ private:
     removed->update_height();
   }
 
-  static void remove_lowest_node(optional_node &current, optional_node &removed) {
+  static void remove_lowest_node(optional_node &root, optional_node &removed) {
     assert(!removed);
-    if (current) {
-      if (!current->low_child) {
-        optional_node temp;
-        temp.swap(current->high_child);
-        temp.swap(current);
-        removed.swap(temp);
-        assert(!temp);
-      } else {
-        remove_lowest_node(current->low_child, removed);
-        update_and_rebalance(current);
-      }
+    if (!root) {
+      return;
+    }
+    optional_node *path[max_height];
+    int depth = 0;
+    optional_node *current = &root;
+    while ((*current)->low_child) {
+      assert(depth < max_height);
+      path[depth++] = current;
+      current = &(*current)->low_child;
     }
+    optional_node temp;
+    temp.swap((*current)->high_child);
+    temp.swap(*current);
+    removed.swap(temp);
+    assert(!temp);
+    rebalance_path(path, depth);
   }
 
-  static void remove_highest_node(optional_node &current, optional_node &removed) {
+  static void remove_highest_node(optional_node &root, optional_node &removed) {
     assert(!removed);
-    if (current) {
-      if (!current->high_child) {
-        optional_node temp;
-        temp.swap(current->low_child);
-        temp.swap(current);
-        removed.swap(temp);
-        assert(!temp);
-      } else {
-        remove_highest_node(current->high_child, removed);
-        update_and_rebalance(current);
-      }
+    if (!root) {
+      return;
     }
+    optional_node *path[max_height];
+    int depth = 0;
+    optional_node *current = &root;
+    while ((*current)->high_child) {
+      assert(depth < max_height);
+      path[depth++] = current;
+      current = &(*current)->high_child;
+    }
+    optional_node temp;
+    temp.swap((*current)->low_child);
+    temp.swap(*current);
+    removed.swap(temp);
+    assert(!temp);
+    rebalance_path(path, depth);
   }
 
+  using augment_data = typename Augment::template node_data <Size>;
+
   const Category category;
   Size           size;
 
@@ -359,6 +1212,12 @@ private:
   FRIEND_TEST(category_node_test, test_pivot_high_low_recursion_2_1);
   FRIEND_TEST(category_tree_test, integration_test);
   FRIEND_TEST(category_tree_test, zero_size_test);
+  FRIEND_TEST(category_tree_test, assign_sorted);
+  FRIEND_TEST(category_tree_test, assign_unsorted);
+  FRIEND_TEST(category_tree_test, update_categories_batch);
+  FRIEND_TEST(category_tree_test, erase_categories_batch);
+  FRIEND_TEST(category_tree_test, integer_sizes_exact);
+  FRIEND_TEST(category_tree_test, split_and_join);
 
   friend class node_printer;
 
@@ -401,4 +1260,99 @@ private:
 
 };
 
+// In-order iteration over the nodes of a tree, i.e., in category order. This
+// keeps an explicit stack of the ancestors that come after the current node,
+// so it doesn't allocate. Incrementing is amortized O(1).
+// NOTE: Any modification of the tree invalidates all iterators.
+template <class Category, class Size, class Augment>
+class category_node <Category, Size, Augment> ::const_iterator {
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type        = category_node;
+  using difference_type   = std::ptrdiff_t;
+  using pointer           = const category_node*;
+  using reference         = const category_node&;
+
+  const_iterator() : depth(0) {}
+
+  // The first node that isn't less than check_category.
+  static const_iterator lower_bound(const category_node *root, const Category &check_category) {
+    const_iterator position;
+    while (root) {
+      if (root->category < check_category) {
+        root = root->high_child.get();
+      } else {
+        position.push(root);
+        root = root->low_child.get();
+      }
+    }
+    return position;
+  }
+
+  // The first node that's greater than check_category.
+  static const_iterator upper_bound(const category_node *root, const Category &check_category) {
+    const_iterator position;
+    while (root) {
+      if (check_category < root->category) {
+        position.push(root);
+        root = root->low_child.get();
+      } else {
+        root = root->high_child.get();
+      }
+    }
+    return position;
+  }
+
+  static const_iterator first(const category_node *root) {
+    const_iterator position;
+    position.push_lowest(root);
+    return position;
+  }
+
+  const category_node &operator * () const {
+    assert(depth > 0);
+    return *path[depth - 1];
+  }
+
+  const category_node *operator -> () const {
+    return &**this;
+  }
+
+  const_iterator &operator ++ () {
+    assert(depth > 0);
+    const category_node *const current = path[--depth];
+    this->push_lowest(current->high_child.get());
+    return *this;
+  }
+
+  const_iterator operator ++ (int) {
+    const_iterator previous(*this);
+    ++*this;
+    return previous;
+  }
+
+  bool operator == (const const_iterator &other) const {
+    return (depth? path[depth - 1] : nullptr) == (other.depth? other.path[other.depth - 1] : nullptr);
+  }
+
+  bool operator != (const const_iterator &other) const {
+    return !(*this == other);
+  }
+
+private:
+  void push(const category_node *node) {
+    assert(depth < max_height);
+    path[depth++] = node;
+  }
+
+  void push_lowest(const category_node *node) {
+    for (; node; node = node->low_child.get()) {
+      this->push(node);
+    }
+  }
+
+  int depth;
+  const category_node *path[max_height];
+};
+
 #endif //category_tree_hpp
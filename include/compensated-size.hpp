@@ -0,0 +1,125 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef compensated_size_hpp
+#define compensated_size_hpp
+
+#include <cmath>
+
+// A floating-point Size for category_tree (and the other trees) that carries a
+// Neumaier compensation term, which makes every total accurate to about one
+// rounding of the exact sum.
+//
+// category_node recomputes total_size from its children on every update rather
+// than adjusting it, so totals never accumulate error over time; with a plain
+// double, the error in a total is bounded by about 2 * height * epsilon times
+// the sum of the sizes below it. Use compensated_size <double> when that isn't
+// tight enough, e.g., when sizes span many orders of magnitude. It costs an
+// extra Value per node and a few more operations per addition.
+//
+// NOTE: Conversion back to Value is explicit, to keep comparisons with plain
+// Values unambiguous. Use value() to get the (rounded) result.
+template <class Value = double>
+class compensated_size {
+public:
+  compensated_size() : sum(), error() {}
+
+  compensated_size(Value initial) : sum(initial), error() {}
+
+  Value value() const {
+    return sum + error;
+  }
+
+  explicit operator Value() const {
+    return this->value();
+  }
+
+  compensated_size &operator += (const compensated_size &other) {
+    this->add(other.sum);
+    this->add(other.error);
+    return *this;
+  }
+
+  compensated_size &operator -= (const compensated_size &other) {
+    this->add(-other.sum);
+    this->add(-other.error);
+    return *this;
+  }
+
+  friend compensated_size operator + (compensated_size left, const compensated_size &right) {
+    return left += right;
+  }
+
+  friend compensated_size operator - (compensated_size left, const compensated_size &right) {
+    return left -= right;
+  }
+
+  // NOTE: Comparisons use the compensated difference, so that they agree with
+  // the subtraction that category_node::locate does after comparing.
+  friend bool operator < (const compensated_size &left, const compensated_size &right) {
+    return (left - right).value() < Value();
+  }
+
+  friend bool operator > (const compensated_size &left, const compensated_size &right) {
+    return right < left;
+  }
+
+  friend bool operator <= (const compensated_size &left, const compensated_size &right) {
+    return !(right < left);
+  }
+
+  friend bool operator >= (const compensated_size &left, const compensated_size &right) {
+    return !(left < right);
+  }
+
+  friend bool operator == (const compensated_size &left, const compensated_size &right) {
+    return (left - right).value() == Value();
+  }
+
+  friend bool operator != (const compensated_size &left, const compensated_size &right) {
+    return !(left == right);
+  }
+
+private:
+  void add(Value added) {
+    const Value new_sum = sum + added;
+    if (std::abs(sum) >= std::abs(added)) {
+      error += (sum - new_sum) + added;
+    } else {
+      error += (added - new_sum) + sum;
+    }
+    sum = new_sum;
+  }
+
+  Value sum, error;
+};
+
+#endif //compensated_size_hpp
@@ -0,0 +1,181 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef decayed_category_tree_hpp
+#define decayed_category_tree_hpp
+
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "category-tree.hpp"
+
+// A category_tree (or other Tree with the same interface) whose sizes can all
+// be decayed at once, e.g., for exponentially-decayed popularity scores.
+//
+// The sizes are stored relative to a global scale: the stored size is the
+// actual size times scale. decay(factor) just divides scale by factor, which
+// is O(1), and new sizes and additions are multiplied by scale before being
+// stored, which is O(log n). Since every stored size is off by the same
+// factor, locate gives the same result as it would for a tree of the actual
+// sizes. Once scale gets close to the limits of Size, all of the stored sizes
+// are renormalized in O(n) (O(n log n) if Tree has no assign), which only
+// happens after decaying by about sqrt(max) overall, e.g., every 512 decays by
+// half with double. Categories that have decayed to 0 by then are erased, but
+// categories explicitly set to 0 are kept, the same as with category_tree.
+template <class Category, class Size = double, template <class...> class Tree = category_tree>
+class decayed_category_tree {
+  static_assert(std::is_floating_point <Size> ::value, "Size must be floating-point");
+
+public:
+  decayed_category_tree() : scale(1) {}
+
+  bool category_exists(const Category &category) const {
+    return categories.category_exists(category);
+  }
+
+  Size category_size(const Category &category) const {
+    return categories.category_size(category) / scale;
+  }
+
+  // See category_node::locate for the semantics.
+  const Category &locate(Size size) const {
+    const Size total = categories.get_total_size();
+    Size position = size * scale;
+    // The product can round up to the stored total.
+    if (!(position < total)) position = std::nextafter(total, Size());
+    return categories.locate(position);
+  }
+
+  // Returns a uniformly-distributed position in [0, get_total_size()) for use
+  // with locate.
+  template <class Generator>
+  Size uniform_position(Generator &generator) const {
+    return ::uniform_position(this->get_total_size(), generator);
+  }
+
+  void update_category(const Category &category, Size new_size) {
+    categories.update_category(category, new_size * scale);
+  }
+
+  // Adds amount to the size of category, e.g., for each new observation.
+  void add_to_category(const Category &category, Size amount) {
+    const Size stored = amount * scale;
+    categories.update_category(category, [stored](Size size) { return size + stored; });
+  }
+
+  void erase_category(const Category &category) {
+    categories.erase_category(category);
+  }
+
+  // Multiplies the size of every category by factor, which must be positive.
+  void decay(Size factor) {
+    assert(factor > Size());
+    scale /= factor;
+    if (!(scale < max_scale() && scale > 1 / max_scale())) {
+      this->renormalize();
+    }
+  }
+
+  Size get_total_size() const {
+    return categories.get_total_size() / scale;
+  }
+
+  // Calls visit(category, size) for each category, in category order.
+  template <class Visit>
+  void for_each(const Visit &visit) const {
+    const Size current_scale = scale;
+    categories.for_each([&visit,current_scale](const Category &category, Size size) {
+      visit(category, size / current_scale);
+    });
+  }
+
+  // The tree of stored sizes, which are the actual sizes times get_scale().
+  const Tree <Category, Size> &get_categories() const {
+    return categories;
+  }
+
+  Size get_scale() const {
+    return scale;
+  }
+
+private:
+  // Leaves room for sizes up to about sqrt(max) without overflow.
+  static Size max_scale() {
+    return std::sqrt(std::numeric_limits <Size> ::max());
+  }
+
+  // Divides every stored size by scale, and then resets scale to 1. Categories
+  // whose nonzero sizes have decayed below the smallest Size are erased.
+  void renormalize() {
+    std::vector <std::pair <Category, Size>> renormalized;
+    std::vector <Category> erased;
+    const Size old_scale = scale;
+    categories.for_each([&renormalized,&erased,old_scale](const Category &category, Size size) {
+      const Size new_size = size / old_scale;
+      if (new_size == Size() && size != Size()) {
+        erased.push_back(category);
+      } else {
+        renormalized.emplace_back(category, new_size);
+      }
+    });
+    replace_categories(categories, renormalized, erased, 0);
+    scale = 1;
+  }
+
+  // Replaces all of the categories, using assign if the container has it.
+  template <class Container>
+  static auto replace_categories(Container &container,
+                                 const std::vector <std::pair <Category, Size>> &renormalized,
+                                 const std::vector <Category> &erased, int)
+    -> decltype(container.assign(renormalized.begin(), renormalized.end()), void()) {
+    container.assign(renormalized.begin(), renormalized.end());
+  }
+  template <class Container>
+  static void replace_categories(Container &container,
+                                 const std::vector <std::pair <Category, Size>> &renormalized,
+                                 const std::vector <Category> &erased, long) {
+    for (const auto &category : erased) {
+      container.erase_category(category);
+    }
+    for (const auto &category : renormalized) {
+      container.update_category(category.first, category.second);
+    }
+  }
+
+  Tree <Category, Size> categories;
+  Size scale;
+};
+
+#endif //decayed_category_tree_hpp
@@ -0,0 +1,274 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef interned_action_timer_hpp
+#define interned_action_timer_hpp
+
+#include <cassert>
+#include <functional>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <time.h>
+
+#include "locking-container.hpp"
+
+#include "action-timer.hpp"
+#include "category-interner.hpp"
+
+// The same as action_timer, except that each category is interned to a 32-bit
+// id the first time it's passed to set_timer or set_action. action_timer then
+// only compares and copies ids, which is much cheaper than, e.g., comparing
+// long strings when finding the category. (Handles avoid that lookup entirely,
+// but interning still helps when the caller only has the category.)
+//
+// Ids are never reused, so memory use grows with the number of distinct
+// categories ever set, not the number currently set. get_category maps an id
+// back to its category, e.g., for logging.
+template <class Category, class Size = double, template <class...> class Tree = category_tree,
+          class Generator = std::default_random_engine>
+class interned_action_timer : public abstract_scaled_timer {
+public:
+  typedef typename category_interner <Category> ::id_type id_type;
+  typedef typename action_timer <id_type, Size, Tree, Generator> ::handle handle;
+
+  explicit interned_action_timer(unsigned int threads = 1, int seed = time(nullptr)) :
+  timer(threads, seed) {}
+
+  explicit interned_action_timer(unsigned int threads, std::function <sleep_timer*()> factory,
+                                 int seed = time(nullptr)) :
+  timer(threads, std::move(factory), seed) {}
+
+  void set_timer_factory(std::function <sleep_timer*()> factory) {
+    timer.set_timer_factory(std::move(factory));
+  }
+
+  void set_scale(double scale) override {
+    timer.set_scale(scale);
+  }
+
+  double get_scale() override {
+    return timer.get_scale();
+  }
+
+  void set_snapshot_sampling(bool enabled) {
+    timer.set_snapshot_sampling(enabled);
+  }
+
+  void set_lock_free_sampling(bool enabled) {
+    timer.set_lock_free_sampling(enabled);
+  }
+
+  bool set_timer(const Category &category, Size lambda, bool overwrite = true) {
+    return timer.set_timer(this->intern(category), lambda, overwrite);
+  }
+
+  void erase_timer(const Category &category);
+
+  // See action_timer::set_timers and action_timer::erase_timers.
+  template <class Iterator>
+  std::size_t set_timers(Iterator begin, Iterator end, bool overwrite = true);
+  template <class Iterator>
+  void erase_timers(Iterator begin, Iterator end);
+
+  bool timer_exists(const Category &category);
+
+  bool set_action(const Category &category, generic_action action, bool overwrite = true) {
+    return timer.set_action(this->intern(category), std::move(action), overwrite);
+  }
+
+  void erase_action(const Category &category);
+  bool action_exists(const Category &category);
+
+  // See action_timer::get_handle.
+  handle get_handle(const Category &category) {
+    return timer.get_handle(this->intern(category));
+  }
+
+  bool handle_exists(const handle &category) {
+    return timer.handle_exists(category);
+  }
+
+  bool set_rate(const handle &category, Size lambda) {
+    return timer.set_rate(category, lambda);
+  }
+
+  bool set_action(const handle &category, generic_action action) {
+    return timer.set_action(category, std::move(action));
+  }
+
+  void erase(const handle &category) {
+    timer.erase(category);
+  }
+
+  // Returns false if category has never been set.
+  bool find_id(const Category &category, id_type &id);
+  // NOTE: It's an error to call this with an id that wasn't set by this timer.
+  Category get_category(id_type id);
+
+  void start() {
+    timer.start();
+  }
+
+  void stop() {
+    timer.stop();
+  }
+
+  bool is_stopped() const {
+    return timer.is_stopped();
+  }
+
+  void wait_stopped() {
+    timer.wait_stopped();
+  }
+
+  void async_stop() {
+    timer.async_stop();
+  }
+
+  bool is_stopping() const {
+    return timer.is_stopping();
+  }
+
+  void wait_stopping() {
+    timer.wait_stopping();
+  }
+
+  bool is_empty() {
+    return timer.is_empty();
+  }
+
+  void wait_empty() {
+    timer.wait_empty();
+  }
+
+private:
+  id_type intern(const Category &category);
+
+  typedef lc::locking_container <category_interner <Category>, lc::rw_lock> locked_interner;
+
+  // NOTE: Must come before timer, so that the threads are stopped first.
+  locked_interner interner;
+  action_timer <id_type, Size, Tree, Generator> timer;
+};
+
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void interned_action_timer <Category, Size, Tree, Generator> ::erase_timer(const Category &category) {
+  id_type id;
+  if (this->find_id(category, id)) {
+    timer.erase_timer(id);
+  }
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+template <class Iterator>
+std::size_t interned_action_timer <Category, Size, Tree, Generator> ::set_timers(Iterator begin, Iterator end,
+                                                                       bool overwrite) {
+  std::vector <std::pair <id_type, Size>> updates;
+  {
+    auto interner_write = interner.get_write();
+    assert(interner_write);
+    for (; begin != end; ++begin) {
+      updates.emplace_back(interner_write->intern(begin->first), begin->second);
+    }
+  }
+  return timer.set_timers(updates.begin(), updates.end(), overwrite);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+template <class Iterator>
+void interned_action_timer <Category, Size, Tree, Generator> ::erase_timers(Iterator begin, Iterator end) {
+  std::vector <id_type> erased;
+  {
+    auto interner_read = interner.get_read();
+    assert(interner_read);
+    for (; begin != end; ++begin) {
+      id_type id;
+      if (interner_read->find_id(*begin, id)) {
+        erased.push_back(id);
+      }
+    }
+  }
+  timer.erase_timers(erased.begin(), erased.end());
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool interned_action_timer <Category, Size, Tree, Generator> ::timer_exists(const Category &category) {
+  id_type id;
+  return this->find_id(category, id) && timer.timer_exists(id);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+void interned_action_timer <Category, Size, Tree, Generator> ::erase_action(const Category &category) {
+  id_type id;
+  if (this->find_id(category, id)) {
+    timer.erase_action(id);
+  }
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool interned_action_timer <Category, Size, Tree, Generator> ::action_exists(const Category &category) {
+  id_type id;
+  return this->find_id(category, id) && timer.action_exists(id);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+bool interned_action_timer <Category, Size, Tree, Generator> ::find_id(const Category &category, id_type &id) {
+  auto interner_read = interner.get_read();
+  assert(interner_read);
+  return interner_read->find_id(category, id);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+Category interned_action_timer <Category, Size, Tree, Generator> ::get_category(id_type id) {
+  auto interner_read = interner.get_read();
+  assert(interner_read);
+  // NOTE: This is a copy, since the interner can't be accessed after unlocking.
+  return interner_read->get_category(id);
+}
+
+template <class Category, class Size, template <class...> class Tree, class Generator>
+typename interned_action_timer <Category, Size, Tree, Generator> ::id_type
+interned_action_timer <Category, Size, Tree, Generator> ::intern(const Category &category) {
+  {
+    id_type id;
+    if (this->find_id(category, id)) {
+      return id;
+    }
+  }
+  auto interner_write = interner.get_write();
+  assert(interner_write);
+  return interner_write->intern(category);
+}
+
+#endif //interned_action_timer_hpp
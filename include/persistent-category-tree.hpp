@@ -0,0 +1,319 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef persistent_category_tree_hpp
+#define persistent_category_tree_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
+// A thread-safe category_tree whose versions are immutable. An update copies
+// only the O(log n) nodes on the path to the category (plus any created by
+// rebalancing), shares everything else with the previous version, and then
+// atomically publishes the new root. Readers never block on writers, and
+// writers never block on readers; writers are serialized with each other.
+// Nodes are reference-counted, so a version (and any node that only it uses)
+// is reclaimed as soon as the last thread referencing it lets it go.
+template <class Category, class Size = double>
+class persistent_category_tree {
+private:
+  struct tree_node;
+  using node_pointer = std::shared_ptr <const tree_node>;
+
+public:
+  // An immutable snapshot of the tree. This is cheap to copy, and it stays
+  // valid regardless of what happens to the tree afterward.
+  class version {
+  public:
+    version() = default;
+
+    bool category_exists(const Category &category) const {
+      return find_node(root.get(), category) != nullptr;
+    }
+
+    Size category_size(const Category &category) const {
+      const tree_node *const found = find_node(root.get(), category);
+      return found? found->size : Size();
+    }
+
+    // See category_node::locate for the semantics.
+    const Category &locate(Size size) const {
+      assert(root && size >= Size() && size < this->get_total_size());
+      const tree_node *current = root.get();
+      while (true) {
+        const tree_node *const low = current->low_child.get();
+        if (low && size < low->total_size) {
+          current = low;
+          continue;
+        }
+        if (low) size -= low->total_size;
+        if (!current->high_child || size < current->size) {
+          assert(current->size != Size());
+          return current->category;
+        }
+        size -= current->size;
+        current = current->high_child.get();
+      }
+    }
+
+    Size get_total_size() const {
+      return root? root->total_size : Size();
+    }
+
+    // Calls visit(category, size) for each category, in category order.
+    template <class Visit>
+    void for_each(const Visit &visit) const {
+      for_each_node(root.get(), visit);
+    }
+
+  private:
+    friend class persistent_category_tree;
+
+    explicit version(node_pointer new_root) : root(std::move(new_root)) {}
+
+    node_pointer root;
+
+#ifdef TESTING
+    FRIEND_TEST(persistent_category_tree_test, integration_test);
+    FRIEND_TEST(persistent_category_tree_test, path_copying);
+#endif
+  };
+
+  persistent_category_tree() = default;
+
+  // The current version. Use this rather than the member functions below when
+  // making more than one query, so that the queries are consistent with each
+  // other and the version is only loaded once.
+  version get_version() const {
+    return version(std::atomic_load(&root));
+  }
+
+  bool category_exists(const Category &category) const {
+    return this->get_version().category_exists(category);
+  }
+
+  Size category_size(const Category &category) const {
+    return this->get_version().category_size(category);
+  }
+
+  // NOTE: This returns a copy, since the version being searched could be
+  // reclaimed as soon as this returns.
+  Category locate(Size size) const {
+    return this->get_version().locate(size);
+  }
+
+  Size get_total_size() const {
+    return this->get_version().get_total_size();
+  }
+
+  template <class Visit>
+  void for_each(const Visit &visit) const {
+    this->get_version().for_each(visit);
+  }
+
+  void update_category(const Category &category, Size new_size) {
+    this->update_category(category, [new_size](Size) { return new_size; });
+  }
+
+  template <class Update,
+            class = typename std::enable_if <!std::is_convertible <Update, Size> ::value> ::type>
+  void update_category(const Category &category, const Update &update) {
+    std::lock_guard <std::mutex> local_lock(write_lock);
+    std::atomic_store(&root, update_node(root, category, update));
+  }
+
+  void erase_category(const Category &category) {
+    std::lock_guard <std::mutex> local_lock(write_lock);
+    node_pointer updated = erase_node(root, category);
+    if (updated != root) {
+      std::atomic_store(&root, std::move(updated));
+    }
+  }
+
+  void clear() {
+    std::lock_guard <std::mutex> local_lock(write_lock);
+    std::atomic_store(&root, node_pointer());
+  }
+
+private:
+  struct tree_node {
+    tree_node(const Category &new_category, Size new_size,
+              node_pointer new_low, node_pointer new_high) :
+    category(new_category), size(new_size), total_size(new_size),
+    height(std::max(get_height(new_low), get_height(new_high)) + 1),
+    low_child(std::move(new_low)), high_child(std::move(new_high)) {
+      // NOTE: This is the same order as category_node::update_size.
+      if (low_child)  total_size += low_child->total_size;
+      if (high_child) total_size += high_child->total_size;
+    }
+
+    const Category category;
+    const Size     size;
+    Size           total_size;
+    const int      height;
+    const node_pointer low_child, high_child;
+  };
+
+  static int get_height(const node_pointer &node) {
+    return node? node->height : 0;
+  }
+
+  static const tree_node *find_node(const tree_node *current, const Category &category) {
+    while (current && !(category == current->category)) {
+      current = (category < current->category)?
+        current->low_child.get() : current->high_child.get();
+    }
+    return current;
+  }
+
+  template <class Visit>
+  static void for_each_node(const tree_node *current, const Visit &visit) {
+    if (!current) return;
+    for_each_node(current->low_child.get(), visit);
+    visit(current->category, current->size);
+    for_each_node(current->high_child.get(), visit);
+  }
+
+  static node_pointer make_node(const Category &category, Size size,
+                                node_pointer low, node_pointer high) {
+    return std::make_shared <const tree_node> (category, size, std::move(low), std::move(high));
+  }
+
+  // Creates a node from the parts, with at most one rotation (single or
+  // double) if the heights of low and high differ by 2.
+  static node_pointer balance_node(const Category &category, Size size,
+                                   node_pointer low, node_pointer high) {
+    const int low_height = get_height(low), high_height = get_height(high);
+    if (high_height > low_height + 1) {
+      if (get_height(high->low_child) > get_height(high->high_child)) {
+        const tree_node &middle = *high->low_child;
+        return make_node(middle.category, middle.size,
+                         make_node(category, size, std::move(low), middle.low_child),
+                         make_node(high->category, high->size, middle.high_child, high->high_child));
+      }
+      return make_node(high->category, high->size,
+                       make_node(category, size, std::move(low), high->low_child),
+                       high->high_child);
+    }
+    if (low_height > high_height + 1) {
+      if (get_height(low->high_child) > get_height(low->low_child)) {
+        const tree_node &middle = *low->high_child;
+        return make_node(middle.category, middle.size,
+                         make_node(low->category, low->size, low->low_child, middle.low_child),
+                         make_node(category, size, middle.high_child, std::move(high)));
+      }
+      return make_node(low->category, low->size,
+                       low->low_child,
+                       make_node(category, size, low->high_child, std::move(high)));
+    }
+    return make_node(category, size, std::move(low), std::move(high));
+  }
+
+  template <class Update>
+  static node_pointer update_node(const node_pointer &current, const Category &category,
+                                  const Update &update) {
+    if (!current) {
+      return make_node(category, update(Size()), nullptr, nullptr);
+    } else if (category == current->category) {
+      return make_node(category, update(current->size), current->low_child, current->high_child);
+    } else if (category < current->category) {
+      return balance_node(current->category, current->size,
+                          update_node(current->low_child, category, update),
+                          current->high_child);
+    } else {
+      return balance_node(current->category, current->size,
+                          current->low_child,
+                          update_node(current->high_child, category, update));
+    }
+  }
+
+  // Returns current itself if category isn't found.
+  static node_pointer erase_node(const node_pointer &current, const Category &category) {
+    if (!current) {
+      return current;
+    } else if (category == current->category) {
+      if (!current->low_child)  return current->high_child;
+      if (!current->high_child) return current->low_child;
+      const tree_node *lowest = current->high_child.get();
+      while (lowest->low_child) lowest = lowest->low_child.get();
+      return balance_node(lowest->category, lowest->size,
+                          current->low_child, erase_lowest(current->high_child));
+    } else if (category < current->category) {
+      node_pointer low = erase_node(current->low_child, category);
+      if (low == current->low_child) return current;
+      return balance_node(current->category, current->size, std::move(low), current->high_child);
+    } else {
+      node_pointer high = erase_node(current->high_child, category);
+      if (high == current->high_child) return current;
+      return balance_node(current->category, current->size, current->low_child, std::move(high));
+    }
+  }
+
+  static node_pointer erase_lowest(const node_pointer &current) {
+    assert(current);
+    if (!current->low_child) {
+      return current->high_child;
+    }
+    return balance_node(current->category, current->size,
+                        erase_lowest(current->low_child), current->high_child);
+  }
+
+  // NOTE: root must only be accessed with std::atomic_load/atomic_store, except
+  // by writers, who hold write_lock.
+  node_pointer root;
+  std::mutex   write_lock;
+
+#ifdef TESTING
+  FRIEND_TEST(persistent_category_tree_test, integration_test);
+  FRIEND_TEST(persistent_category_tree_test, path_copying);
+  FRIEND_TEST(persistent_category_tree_test, concurrent_readers);
+
+  // Returns the height of the subtree, or -1 if it's invalid.
+  static int validate_node(const tree_node *current) {
+    if (!current) return 0;
+    if (current->low_child  && !(current->low_child->category < current->category)) return -1;
+    if (current->high_child && !(current->category < current->high_child->category)) return -1;
+    const int low_height  = validate_node(current->low_child.get());
+    const int high_height = validate_node(current->high_child.get());
+    if (low_height < 0 || high_height < 0) return -1;
+    if (std::abs(high_height - low_height) > 1) return -1;
+    if (current->height != std::max(low_height, high_height) + 1) return -1;
+    return current->height;
+  }
+#endif
+};
+
+#endif //persistent_category_tree_hpp
@@ -0,0 +1,113 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef philox_generator_hpp
+#define philox_generator_hpp
+
+#include <array>
+#include <cstdint>
+#include <limits>
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3"),
+// a counter-based UniformRandomBitGenerator. Each output block is a pure
+// function of (key, counter), so any part of the sequence can be computed
+// directly, without generating what comes before it.
+//
+// The key is the seed, and set_stream(stream) starts an independent sequence
+// of 2^32 blocks for that stream number. action_timer uses the event index as
+// the stream, so the random numbers for the k-th event depend only on the seed
+// and k, no matter which thread handles it. To reproduce event k elsewhere, do
+// the same: seed with the timer's seed, call set_stream(k), and then draw the
+// same distributions in the same order as action_timer::thread_loop.
+// NOTE: action_timer orders its timers by slot index, not by category, and
+// indices are reused once a category is released. Mapping a draw back to the
+// same category therefore also requires creating and releasing categories in
+// the same order, i.e., replaying the calls that modified the timer.
+class philox4x32 {
+public:
+  using result_type = std::uint32_t;
+  using block_type  = std::array <std::uint32_t, 4>;
+  using key_type    = std::array <std::uint32_t, 2>;
+
+  explicit philox4x32(std::uint64_t new_seed = 0) {
+    this->seed(new_seed);
+  }
+
+  void seed(std::uint64_t new_seed) {
+    key = key_type {{ std::uint32_t(new_seed), std::uint32_t(new_seed >> 32) }};
+    this->set_stream(0);
+  }
+
+  // Restarts the output at the beginning of the given stream.
+  void set_stream(std::uint64_t stream) {
+    counter = block_type {{ std::uint32_t(stream), std::uint32_t(stream >> 32), 0, 0 }};
+    used = 4;
+  }
+
+  static constexpr result_type min() {
+    return 0;
+  }
+
+  static constexpr result_type max() {
+    return std::numeric_limits <result_type> ::max();
+  }
+
+  result_type operator () () {
+    if (used == 4) {
+      output = block(counter, key);
+      ++counter[2];
+      used = 0;
+    }
+    return output[used++];
+  }
+
+  // The Philox4x32-10 bijection.
+  static block_type block(block_type counter, key_type key) {
+    for (int round = 0; round < 10; ++round) {
+      const std::uint64_t product0 = std::uint64_t(0xD2511F53) * counter[0];
+      const std::uint64_t product1 = std::uint64_t(0xCD9E8D57) * counter[2];
+      counter = block_type {{
+        std::uint32_t(product1 >> 32) ^ counter[1] ^ key[0], std::uint32_t(product1),
+        std::uint32_t(product0 >> 32) ^ counter[3] ^ key[1], std::uint32_t(product0)
+      }};
+      key[0] += 0x9E3779B9;
+      key[1] += 0xBB67AE85;
+    }
+    return counter;
+  }
+
+private:
+  key_type   key;
+  block_type counter, output;
+  int        used;
+};
+
+#endif //philox_generator_hpp
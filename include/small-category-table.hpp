@@ -0,0 +1,201 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef small_category_table_hpp
+#define small_category_table_hpp
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+
+// A fixed-capacity replacement for category_tree, for when there are only a
+// few dozen categories. Everything is stored inline in sorted arrays, so there
+// are no heap allocations, and locate is a branchless binary search over the
+// running totals rather than a pointer-chasing descent. Updates are a store
+// plus recomputing the running totals after it, which is O(N) with a small N.
+// Use small_category_tables <N> ::type to pass this to action_timer.
+//
+// NOTE: Category must be default-constructible.
+template <class Category, class Size = double, std::size_t N = 64>
+class small_category_table {
+public:
+  small_category_table() : count(0), keys(), sizes(), cumulative() {}
+
+  bool category_exists(const Category &category) const {
+    return this->find_index(category) < count;
+  }
+
+  Size category_size(const Category &category) const {
+    const std::size_t index = this->find_index(category);
+    return (index < count)? sizes[index] : Size();
+  }
+
+  // See category_node::locate for the semantics.
+  const Category &locate(Size size) const {
+    assert(count > 0 && size >= Size() && size < this->get_total_size());
+    // Branchless binary search for the first running total > size. (For small
+    // tables this beats a linear scan, which the compiler doesn't vectorize
+    // without enabling newer instruction sets.)
+    const Size *base = cumulative.data();
+    std::size_t remaining = count;
+    while (remaining > 1) {
+      const std::size_t half = remaining / 2;
+      base = (size < base[half - 1])? base : base + half;
+      remaining -= half;
+    }
+    std::size_t index = (base - cumulative.data()) + !(size < *base);
+    if (index >= count) {
+      // Precision error; see category_node::locate.
+      index = count - 1;
+      while (index > 0 && sizes[index] == Size()) --index;
+    }
+    return keys[index];
+  }
+
+  Size get_total_size() const {
+    return count? cumulative[count - 1] : Size();
+  }
+
+  std::size_t category_count() const {
+    return count;
+  }
+
+  static constexpr std::size_t capacity() {
+    return N;
+  }
+
+  // Returns false if category is new and the table is already full.
+  bool update_category(const Category &category, Size new_size) {
+    return this->update_category(category, [new_size](Size) { return new_size; });
+  }
+
+  template <class Update,
+            class = typename std::enable_if <!std::is_convertible <Update, Size> ::value> ::type>
+  bool update_category(const Category &category, const Update &update) {
+    const std::size_t index = this->lower_index(category);
+    if (index < count && keys[index] == category) {
+      sizes[index] = update(sizes[index]);
+    } else {
+      if (count == N) {
+        return false;
+      }
+      std::move_backward(keys.begin() + index, keys.begin() + count, keys.begin() + count + 1);
+      std::copy_backward(sizes.begin() + index, sizes.begin() + count, sizes.begin() + count + 1);
+      keys[index]  = category;
+      sizes[index] = update(Size());
+      ++count;
+    }
+    this->update_cumulative(index);
+    return true;
+  }
+
+  void erase_category(const Category &category) {
+    const std::size_t index = this->find_index(category);
+    if (index < count) {
+      std::move(keys.begin() + index + 1, keys.begin() + count, keys.begin() + index);
+      std::copy(sizes.begin() + index + 1, sizes.begin() + count, sizes.begin() + index);
+      --count;
+      keys[count]  = Category();
+      sizes[count] = Size();
+      this->update_cumulative(index);
+    }
+  }
+
+  // Batch versions of update_category and erase_category. [begin, end)
+  // contains (Category, Size) pairs or categories, respectively. Returns the
+  // number of categories updated, which is less than the batch size if the
+  // table fills up.
+  template <class Iterator>
+  std::size_t update_categories(Iterator begin, Iterator end) {
+    std::size_t updated = 0;
+    for (; begin != end; ++begin) {
+      updated += this->update_category(begin->first, begin->second);
+    }
+    return updated;
+  }
+
+  template <class Iterator>
+  void erase_categories(Iterator begin, Iterator end) {
+    for (; begin != end; ++begin) {
+      this->erase_category(*begin);
+    }
+  }
+
+  // Calls visit(category, size) for each category, in category order.
+  template <class Visit>
+  void for_each(const Visit &visit) const {
+    for (std::size_t i = 0; i < count; ++i) {
+      visit(keys[i], sizes[i]);
+    }
+  }
+
+private:
+  std::size_t lower_index(const Category &category) const {
+    return std::lower_bound(keys.begin(), keys.begin() + count, category) - keys.begin();
+  }
+
+  // Returns count if category isn't found.
+  std::size_t find_index(const Category &category) const {
+    const std::size_t index = this->lower_index(category);
+    return (index < count && keys[index] == category)? index : count;
+  }
+
+  // Recomputes the running totals starting at index, which is the first entry
+  // that changed.
+  // NOTE: The totals are always recomputed from the sizes rather than being
+  // adjusted, so that precision errors don't accumulate.
+  void update_cumulative(std::size_t index) {
+    Size total = (index > 0)? cumulative[index - 1] : Size();
+    for (std::size_t i = index; i < count; ++i) {
+      total += sizes[i];
+      cumulative[i] = total;
+    }
+  }
+
+  std::size_t count;
+  std::array <Category, N> keys;
+  std::array <Size, N>     sizes;
+  std::array <Size, N>     cumulative;
+};
+
+// Binds N, so that small_category_table can be used where a template with only
+// type parameters is expected, e.g., action_timer's Tree parameter:
+//
+//   action_timer <int, double, small_category_tables <16> ::type> timer;
+template <std::size_t N>
+struct small_category_tables {
+  template <class Category, class Size = double>
+  using type = small_category_table <Category, Size, N>;
+};
+
+#endif //small_category_table_hpp
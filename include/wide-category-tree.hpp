@@ -0,0 +1,454 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef wide_category_tree_hpp
+#define wide_category_tree_hpp
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// A B+-tree version of category_tree, with the same interface. Each node holds
+// up to Width entries, with the running totals of the entries stored
+// contiguously, so choosing the next child in locate is a branchless
+// count-and-compare over one array (which the compiler can vectorize) rather
+// than a pointer chase per binary level. With the default Width, 10M
+// categories are only 6 levels deep.
+//
+// NOTE: Category must be default-constructible, since keys are stored in
+// fixed-size arrays.
+template <class Category, class Size = double, int Width = 16>
+class wide_category_tree {
+  static_assert(Width >= 4 && Width % 2 == 0, "Width must be even and at least 4");
+
+public:
+  wide_category_tree() = default;
+
+  bool category_exists(const Category &category) const {
+    return this->find_entry(category) != nullptr;
+  }
+
+  Size category_size(const Category &category) const {
+    const Size *const found = this->find_entry(category);
+    return found? *found : Size();
+  }
+
+  // See category_node::locate for the semantics.
+  const Category &locate(Size size) const {
+    assert(root && size >= Size() && size < this->get_total_size());
+    const wide_node *current = root.get();
+    while (true) {
+      int index = 0;
+      // NOTE: This is deliberately branchless, to allow vectorization.
+      for (int i = 0; i < Width; ++i) {
+        index += (i < current->count) & !(size < current->cumulative[i]);
+      }
+      if (index >= current->count) {
+        // Precision error; see category_node::locate.
+        index = current->count - 1;
+        if (current->leaf) {
+          while (index > 0 && current->sizes[index] == Size()) --index;
+        }
+      }
+      if (index > 0) size -= current->cumulative[index - 1];
+      if (current->leaf) {
+        return current->keys[index];
+      }
+      current = as_branch(current)->children[index].get();
+    }
+  }
+
+  Size get_total_size() const {
+    return root? root->get_total_size() : Size();
+  }
+
+  void update_category(const Category &category, Size new_size) {
+    this->update_category(category, [new_size](Size) { return new_size; });
+  }
+
+  template <class Update,
+            class = typename std::enable_if <!std::is_convertible <Update, Size> ::value> ::type>
+  void update_category(const Category &category, const Update &update) {
+    if (!root) {
+      root.reset(new wide_node(true));
+    }
+    node_pointer split = update_node(*root, category, update);
+    if (split) {
+      std::unique_ptr <wide_branch> new_root(new wide_branch);
+      new_root->children[0] = std::move(root);
+      new_root->children[1] = std::move(split);
+      new_root->count = 2;
+      refresh_entry(*new_root, 0);
+      refresh_entry(*new_root, 1);
+      new_root->update_cumulative();
+      root.reset(new_root.release());
+    }
+  }
+
+  void erase_category(const Category &category) {
+    if (!root || !erase_node(*root, category)) {
+      return;
+    }
+    if (root->count == 0) {
+      root.reset();
+    } else if (!root->leaf && root->count == 1) {
+      node_pointer only_child = std::move(as_branch(root.get())->children[0]);
+      root = std::move(only_child);
+    }
+  }
+
+  // Batch versions of update_category and erase_category. [begin, end)
+  // contains (Category, Size) pairs or categories, respectively.
+  template <class Iterator>
+  void update_categories(Iterator begin, Iterator end) {
+    for (; begin != end; ++begin) {
+      this->update_category(begin->first, begin->second);
+    }
+  }
+
+  template <class Iterator>
+  void erase_categories(Iterator begin, Iterator end) {
+    for (; begin != end; ++begin) {
+      this->erase_category(*begin);
+    }
+  }
+
+  // Calls visit(category, size) for each category, in category order.
+  template <class Visit>
+  void for_each(const Visit &visit) const {
+    if (root) {
+      for_each_node(*root, visit);
+    }
+  }
+
+private:
+  struct wide_node;
+  struct wide_branch;
+
+  struct node_deleter {
+    void operator () (wide_node *node) const {
+      if (node->leaf) {
+        delete node;
+      } else {
+        delete static_cast <wide_branch*> (node);
+      }
+    }
+  };
+
+  using node_pointer = std::unique_ptr <wide_node, node_deleter>;
+
+  // For a leaf, the entries are categories and their sizes. For a branch, they
+  // are the lowest category in each child and the child's total size.
+  struct wide_node {
+    explicit wide_node(bool is_leaf) : leaf(is_leaf), count(0), cumulative(), sizes(), keys() {}
+
+    Size get_total_size() const {
+      return count? cumulative[count - 1] : Size();
+    }
+
+    // NOTE: The totals are always recomputed from the sizes rather than being
+    // adjusted, so that precision errors don't accumulate.
+    void update_cumulative() {
+      Size total = Size();
+      for (int i = 0; i < count; ++i) {
+        total += sizes[i];
+        cumulative[i] = total;
+      }
+    }
+
+    const bool leaf;
+    int  count;
+    Size cumulative[Width];
+    Size sizes[Width];
+    Category keys[Width];
+  };
+
+  struct wide_branch : public wide_node {
+    wide_branch() : wide_node(false) {}
+
+    node_pointer children[Width];
+  };
+
+  static wide_branch *as_branch(wide_node *node) {
+    assert(!node->leaf);
+    return static_cast <wide_branch*> (node);
+  }
+
+  static const wide_branch *as_branch(const wide_node *node) {
+    assert(!node->leaf);
+    return static_cast <const wide_branch*> (node);
+  }
+
+  // Index of the child of a branch that could contain category.
+  static int child_index(const wide_node &node, const Category &category) {
+    int index = 0;
+    for (int i = 1; i < node.count; ++i) {
+      index += !(category < node.keys[i]);
+    }
+    return index;
+  }
+
+  // Index of the first entry of a leaf that isn't less than category.
+  static int leaf_index(const wide_node &node, const Category &category) {
+    return std::lower_bound(node.keys, node.keys + node.count, category) - node.keys;
+  }
+
+  const Size *find_entry(const Category &category) const {
+    const wide_node *current = root.get();
+    if (!current) return nullptr;
+    while (!current->leaf) {
+      current = as_branch(current)->children[child_index(*current, category)].get();
+    }
+    const int index = leaf_index(*current, category);
+    if (index < current->count && current->keys[index] == category) {
+      return &current->sizes[index];
+    } else {
+      return nullptr;
+    }
+  }
+
+  template <class Visit>
+  static void for_each_node(const wide_node &node, const Visit &visit) {
+    for (int i = 0; i < node.count; ++i) {
+      if (node.leaf) {
+        visit(node.keys[i], node.sizes[i]);
+      } else {
+        for_each_node(*as_branch(&node)->children[i], visit);
+      }
+    }
+  }
+
+  // Copies the key and total of child index into the branch's entry. The
+  // caller must call update_cumulative afterward.
+  static void refresh_entry(wide_node &node, int index) {
+    const wide_node &child = *as_branch(&node)->children[index];
+    node.keys[index]  = child.keys[0];
+    node.sizes[index] = child.get_total_size();
+  }
+
+  static void move_entry(wide_node &from, int from_index, wide_node &to, int to_index) {
+    to.keys[to_index]  = std::move(from.keys[from_index]);
+    to.sizes[to_index] = from.sizes[from_index];
+    if (!from.leaf) {
+      as_branch(&to)->children[to_index] = std::move(as_branch(&from)->children[from_index]);
+    }
+  }
+
+  // Moves entries [index, count) of node to start at index + shift.
+  static void shift_entries(wide_node &node, int index, int shift) {
+    if (shift > 0) {
+      for (int i = node.count - 1; i >= index; --i) {
+        move_entry(node, i, node, i + shift);
+      }
+    } else {
+      for (int i = index; i < node.count; ++i) {
+        move_entry(node, i, node, i + shift);
+      }
+    }
+  }
+
+  // Inserts an entry at index, splitting node if it's full. Returns the new
+  // right sibling if node was split. The cumulative sizes of both are updated.
+  static node_pointer insert_entry(wide_node &node, int index, const Category &category,
+                                   Size size, node_pointer child) {
+    node_pointer split;
+    wide_node *target = &node;
+    if (node.count == Width) {
+      split.reset(node.leaf? new wide_node(true) : new wide_branch);
+      for (int i = Width / 2; i < Width; ++i) {
+        move_entry(node, i, *split, i - Width / 2);
+      }
+      node.count = split->count = Width / 2;
+      if (index > Width / 2) {
+        target = split.get();
+        index -= Width / 2;
+      }
+    }
+    shift_entries(*target, index, 1);
+    target->keys[index]  = category;
+    target->sizes[index] = size;
+    if (!target->leaf) {
+      as_branch(target)->children[index] = std::move(child);
+    }
+    ++target->count;
+    node.update_cumulative();
+    if (split) {
+      split->update_cumulative();
+    }
+    return split;
+  }
+
+  template <class Update>
+  static node_pointer update_node(wide_node &node, const Category &category,
+                                  const Update &update) {
+    if (node.leaf) {
+      const int index = leaf_index(node, category);
+      if (index < node.count && node.keys[index] == category) {
+        node.sizes[index] = update(node.sizes[index]);
+        node.update_cumulative();
+        return nullptr;
+      }
+      return insert_entry(node, index, category, update(Size()), nullptr);
+    } else {
+      const int index = child_index(node, category);
+      node_pointer split = update_node(*as_branch(&node)->children[index], category, update);
+      refresh_entry(node, index);
+      if (split) {
+        const Category split_key = split->keys[0];
+        const Size split_size = split->get_total_size();
+        return insert_entry(node, index + 1, split_key, split_size, std::move(split));
+      }
+      node.update_cumulative();
+      return nullptr;
+    }
+  }
+
+  // Returns false if category wasn't found.
+  static bool erase_node(wide_node &node, const Category &category) {
+    if (node.leaf) {
+      const int index = leaf_index(node, category);
+      if (index == node.count || !(node.keys[index] == category)) {
+        return false;
+      }
+      shift_entries(node, index + 1, -1);
+      --node.count;
+      node.update_cumulative();
+      return true;
+    } else {
+      const int index = child_index(node, category);
+      wide_node &child = *as_branch(&node)->children[index];
+      if (!erase_node(child, category)) {
+        return false;
+      }
+      if (child.count < Width / 2) {
+        rebalance_child(node, index);
+      } else {
+        refresh_entry(node, index);
+      }
+      node.update_cumulative();
+      return true;
+    }
+  }
+
+  // Merges an underfull child with a sibling, or moves entries from the
+  // sibling if they won't both fit into one node.
+  static void rebalance_child(wide_node &node, int index) {
+    if (node.count == 1) {
+      // Only possible for the root, which erase_category collapses.
+      refresh_entry(node, index);
+      return;
+    }
+    const int low_index = (index > 0)? index - 1 : index;
+    wide_node &low  = *as_branch(&node)->children[low_index];
+    wide_node &high = *as_branch(&node)->children[low_index + 1];
+    if (low.count + high.count <= Width) {
+      for (int i = 0; i < high.count; ++i) {
+        move_entry(high, i, low, low.count + i);
+      }
+      low.count += high.count;
+      high.count = 0;
+      low.update_cumulative();
+      as_branch(&node)->children[low_index + 1].reset();
+      shift_entries(node, low_index + 2, -1);
+      --node.count;
+      refresh_entry(node, low_index);
+      return;
+    }
+    const int target = (low.count + high.count) / 2;
+    if (low.count < target) {
+      const int moved = target - low.count;
+      for (int i = 0; i < moved; ++i) {
+        move_entry(high, i, low, low.count + i);
+      }
+      low.count += moved;
+      shift_entries(high, moved, -moved);
+      high.count -= moved;
+    } else {
+      const int moved = low.count - target;
+      shift_entries(high, 0, moved);
+      high.count += moved;
+      for (int i = 0; i < moved; ++i) {
+        move_entry(low, target + i, high, i);
+      }
+      low.count -= moved;
+    }
+    low.update_cumulative();
+    high.update_cumulative();
+    refresh_entry(node, low_index);
+    refresh_entry(node, low_index + 1);
+  }
+
+  node_pointer root;
+
+#ifdef TESTING
+  FRIEND_TEST(wide_category_tree_test, integration_test);
+  FRIEND_TEST(wide_category_tree_test, random_operations);
+
+  bool validate_tree() const {
+    int leaf_depth = -1;
+    return !root || validate_node(*root, true, 0, leaf_depth);
+  }
+
+  static bool validate_node(const wide_node &node, bool is_root, int depth, int &leaf_depth) {
+    if (node.count < (is_root? 1 : Width / 2) || node.count > Width) return false;
+    Size total = Size();
+    for (int i = 0; i < node.count; ++i) {
+      if (i > 0 && !(node.keys[i - 1] < node.keys[i])) return false;
+      total += node.sizes[i];
+      if (!(node.cumulative[i] == total)) return false;
+      if (!node.leaf) {
+        const wide_node &child = *as_branch(&node)->children[i];
+        if (!(child.keys[0] == node.keys[i])) return false;
+        if (!(child.get_total_size() == node.sizes[i])) return false;
+        if (i + 1 < node.count && !(child.keys[child.count - 1] < node.keys[i + 1])) return false;
+        if (!validate_node(child, false, depth + 1, leaf_depth)) return false;
+      }
+    }
+    if (node.leaf) {
+      if (leaf_depth < 0) leaf_depth = depth;
+      if (leaf_depth != depth) return false;
+    }
+    return true;
+  }
+#endif
+};
+
+// Binds Width, so that wide_category_tree can be used where a template with
+// only type parameters is expected, e.g., action_timer's Tree parameter.
+template <int Width>
+struct wide_category_trees {
+  template <class Category, class Size = double>
+  using type = wide_category_tree <Category, Size, Width>;
+};
+
+#endif //wide_category_tree_hpp
@@ -0,0 +1,118 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#ifndef xoshiro_generator_hpp
+#define xoshiro_generator_hpp
+
+#include <cstdint>
+#include <limits>
+
+// xoshiro256** (Blackman and Vigna), a UniformRandomBitGenerator that's much
+// faster than std::default_random_engine and has 64-bit output with a period of
+// 2^256 - 1. jump() advances it by 2^128 steps, which splits one seed into
+// non-overlapping streams, e.g., one per thread. (See action_timer.)
+class xoshiro256_starstar {
+public:
+  using result_type = std::uint64_t;
+
+  explicit xoshiro256_starstar(result_type new_seed = 0) {
+    this->seed(new_seed);
+  }
+
+  // The state is filled using splitmix64, so that similar seeds (e.g., 0 and 1)
+  // still give unrelated sequences.
+  void seed(result_type new_seed) {
+    for (result_type &word : state) {
+      new_seed += 0x9e3779b97f4a7c15ULL;
+      result_type mixed = new_seed;
+      mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebULL;
+      word = mixed ^ (mixed >> 31);
+    }
+  }
+
+  static constexpr result_type min() {
+    return 0;
+  }
+
+  static constexpr result_type max() {
+    return std::numeric_limits <result_type> ::max();
+  }
+
+  result_type operator () () {
+    const result_type result = rotate(state[1] * 5, 7) * 9;
+    const result_type shifted = state[1] << 17;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= shifted;
+    state[3] = rotate(state[3], 45);
+    return result;
+  }
+
+  // Equivalent to 2^128 calls to operator ().
+  void jump() {
+    static const result_type polynomial[] = {
+      0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+    };
+    result_type jumped[4] = { 0, 0, 0, 0 };
+    for (result_type word : polynomial) {
+      for (int bit = 0; bit < 64; ++bit) {
+        if (word & (result_type(1) << bit)) {
+          for (int i = 0; i < 4; ++i) jumped[i] ^= state[i];
+        }
+        (*this)();
+      }
+    }
+    for (int i = 0; i < 4; ++i) state[i] = jumped[i];
+  }
+
+  bool operator == (const xoshiro256_starstar &other) const {
+    for (int i = 0; i < 4; ++i) {
+      if (state[i] != other.state[i]) return false;
+    }
+    return true;
+  }
+
+  bool operator != (const xoshiro256_starstar &other) const {
+    return !(*this == other);
+  }
+
+private:
+  static result_type rotate(result_type value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+  }
+
+  result_type state[4];
+};
+
+#endif //xoshiro_generator_hpp
@@ -0,0 +1,182 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+// Usage: action-timer-benchmark [thread count...]
+// Measures how many events per second action_timer can generate when sleeping
+// is free, i.e., the overhead of the timer threads themselves. With no thread
+// counts, 1 to 8 threads are used. The second table compares the locked path
+// with lock-free sampling, both with and without another thread continuously
+// updating the timers. The last line compares how fast the rates of many
+// string categories can be updated by key and by handle.
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "action-timer.hpp"
+#include "philox-generator.hpp"
+#include "xoshiro-generator.hpp"
+
+namespace {
+
+// Returns immediately, so that the timer threads spend all of their time on
+// choosing and triggering events.
+class null_timer : public sleep_timer {
+public:
+  void mark() override {}
+  void sleep_for(double time, std::function <bool()> cancel) override {}
+};
+
+// Padded so that threads triggering different categories don't share a cache
+// line, which would limit scaling for reasons unrelated to the timer.
+struct event_counter {
+  std::atomic <long> count;
+  char padding[64 - sizeof(std::atomic <long>)];
+};
+
+const int category_count = 1000;
+const double run_seconds = 1.0;
+const int update_count = 100000;
+
+template <class Timer>
+double events_per_second(unsigned int threads, bool lock_free = false, bool contended = false) {
+  Timer timer(threads, [] { return new null_timer; }, 1);
+  timer.set_lock_free_sampling(lock_free);
+  std::unique_ptr <event_counter[]> counters(new event_counter[category_count]);
+  for (int i = 0; i < category_count; ++i) {
+    counters[i].count = 0;
+    event_counter *const counter = &counters[i];
+    timer.set_timer(i, 1.0 + i % 7);
+    timer.set_action(i, abstract_scaled_timer::generic_action(new sync_action([counter] {
+      counter->count.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    })));
+  }
+  const auto start = std::chrono::steady_clock::now();
+  timer.start();
+  std::atomic <bool> writing(contended);
+  std::thread writer([&timer,&writing] {
+    for (int i = 0; writing; i = (i + 1) % category_count) {
+      timer.set_timer(i, 1.0 + (i + 1) % 7);
+    }
+  });
+  std::this_thread::sleep_for(std::chrono::duration <double> (run_seconds));
+  writing = false;
+  writer.join();
+  timer.stop();
+  const double elapsed =
+    std::chrono::duration <double> (std::chrono::steady_clock::now() - start).count();
+  long total = 0;
+  for (int i = 0; i < category_count; ++i) {
+    total += counters[i].count;
+  }
+  return total / elapsed;
+}
+
+// Returns the number of rate updates per second for update_count categories.
+template <class Update>
+double updates_per_second(const Update &update) {
+  const auto start = std::chrono::steady_clock::now();
+  long updates = 0;
+  while (std::chrono::steady_clock::now() - start < std::chrono::duration <double> (run_seconds)) {
+    for (int i = 0; i < update_count; ++i) {
+      update(i, 1.0 + (updates + i) % 7);
+    }
+    updates += update_count;
+  }
+  const double elapsed =
+    std::chrono::duration <double> (std::chrono::steady_clock::now() - start).count();
+  return updates / elapsed;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::vector <unsigned int> thread_counts;
+  for (int i = 1; i < argc; ++i) {
+    char *end = nullptr;
+    const unsigned long count = strtoul(argv[i], &end, 10);
+    if (!*argv[i] || *end || count == 0) {
+      fprintf(stderr, "%s: Invalid thread count \"%s\".\n", argv[0], argv[i]);
+      return 1;
+    }
+    thread_counts.push_back(count);
+  }
+  if (thread_counts.empty()) {
+    thread_counts = { 1, 2, 4, 8 };
+  }
+
+  printf("%-8s %12s %12s %12s\n", "threads", "default_eps", "xoshiro_eps", "philox_eps");
+  for (unsigned int threads : thread_counts) {
+    const double default_eps = events_per_second <action_timer <int>> (threads);
+    const double xoshiro_eps =
+      events_per_second <action_timer <int, double, category_tree, xoshiro256_starstar>> (threads);
+    const double philox_eps =
+      events_per_second <action_timer <int, double, category_tree, philox4x32>> (threads);
+    printf("%-8u %12.0f %12.0f %12.0f\n", threads, default_eps, xoshiro_eps, philox_eps);
+  }
+
+  printf("\n%-8s %12s %12s %12s %12s\n", "threads", "locked_eps", "free_eps",
+         "locked_w_eps", "free_w_eps");
+  for (unsigned int threads : thread_counts) {
+    typedef action_timer <int, double, category_tree, xoshiro256_starstar> timer_type;
+    const double locked_eps   = events_per_second <timer_type> (threads, false, false);
+    const double free_eps     = events_per_second <timer_type> (threads, true,  false);
+    const double locked_w_eps = events_per_second <timer_type> (threads, false, true);
+    const double free_w_eps   = events_per_second <timer_type> (threads, true,  true);
+    printf("%-8u %12.0f %12.0f %12.0f %12.0f\n", threads, locked_eps, free_eps,
+           locked_w_eps, free_w_eps);
+  }
+
+  typedef action_timer <std::string> string_timer;
+  string_timer timer;
+  std::vector <std::string> categories;
+  std::vector <string_timer::handle> handles;
+  for (int i = 0; i < update_count; ++i) {
+    categories.push_back("/some/long/common/prefix/category/" + std::to_string(i));
+    handles.push_back(timer.get_handle(categories.back()));
+  }
+  const double key_ups = updates_per_second([&timer,&categories](int i, double lambda) {
+    timer.set_timer(categories[i], lambda);
+  });
+  const double handle_ups = updates_per_second([&timer,&handles](int i, double lambda) {
+    timer.set_rate(handles[i], lambda);
+  });
+  printf("\n%-8s %12s %12s\n", "updates", "key_ups", "handle_ups");
+  printf("%-8d %12.0f %12.0f\n", update_count, key_ups, handle_ups);
+}
@@ -0,0 +1,548 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2016-2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+#include <gtest/gtest.h>
+
+#define TESTING
+#include "action-timer.hpp"
+#include "philox-generator.hpp"
+#include "small-category-table.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// The last sleep time passed to a recording_timer by the current thread.
+thread_local double last_sleep = 0;
+
+// Doesn't sleep, but records the sleep time, so that the action that's
+// triggered next by the same thread can tell which event triggered it.
+class recording_timer : public sleep_timer {
+public:
+  void mark() override {}
+  void sleep_for(double time, std::function <bool()> cancel) override {
+    last_sleep = time;
+  }
+};
+
+// Returns (exponential draw, category) for each event, in trigger order.
+std::vector <std::pair <double, int>> record_events(unsigned int threads, std::size_t count,
+                                                    bool snapshot_sampling) {
+  typedef action_timer <int, double, category_tree, philox4x32> timer_type;
+  timer_type timer(threads, [] { return new recording_timer; }, 7);
+  timer.set_snapshot_sampling(snapshot_sampling);
+  std::mutex events_lock;
+  std::vector <std::pair <double, int>> events;
+  double total = 0;
+  for (int i = 0; i < 20; ++i) {
+    total += i + 1;
+    timer.set_timer(i, i + 1);
+  }
+  for (int i = 0; i < 20; ++i) {
+    timer.set_action(i, abstract_scaled_timer::generic_action(new sync_action(
+      [&timer,&events_lock,&events,i,threads,total,count] {
+        std::lock_guard <std::mutex> local_lock(events_lock);
+        // Undoes the scaling of the exponential draw. (See thread_loop.)
+        events.emplace_back(last_sleep * total / threads, i);
+        if (events.size() == count) {
+          timer.async_stop();
+        }
+        return true;
+      })));
+  }
+  timer.start();
+  timer.wait_stopping();
+  timer.stop();
+  events.resize(count);
+  return events;
+}
+
+// Doesn't sleep at all.
+class null_timer : public sleep_timer {
+public:
+  void mark() override {}
+  void sleep_for(double time, std::function <bool()> cancel) override {}
+};
+
+// Tracks whether an action is being triggered, and whether it was triggered
+// after it was supposed to be gone.
+struct trigger_state {
+  trigger_state() : running(0), started(false), removed(false), late(0) {}
+  std::atomic <int>  running;
+  std::atomic <bool> started, removed;
+  std::atomic <int>  late;
+};
+
+// Unlike sync_action, destructing this doesn't wait for the action to finish,
+// the same as an action that refers to something destructed right after the
+// action is replaced.
+class slow_action : public abstract_action {
+public:
+  explicit slow_action(trigger_state &new_state) : state(new_state) {}
+
+  void start() override {}
+
+  bool trigger_action() override {
+    ++state.running;
+    state.started = true;
+    if (state.removed) {
+      ++state.late;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    --state.running;
+    return true;
+  }
+
+private:
+  trigger_state &state;
+};
+
+abstract_scaled_timer::generic_action make_slow_action(trigger_state &state) {
+  return abstract_scaled_timer::generic_action(new slow_action(state));
+}
+
+// Counts the events for each of a few categories.
+struct event_counts {
+  static const int categories = 4;
+
+  event_counts() : total(0) {
+    for (auto &count : counts) count = 0;
+  }
+
+  // Returns the total after waiting for at least count more events.
+  long wait_for(long count) {
+    const long target = total + count;
+    while (total < target) {
+      std::this_thread::yield();
+    }
+    return total;
+  }
+
+  std::atomic <long> total;
+  std::atomic <long> counts[categories];
+};
+
+template <class Timer>
+void set_counting_actions(Timer &timer, event_counts &events) {
+  for (int i = 0; i < event_counts::categories; ++i) {
+    timer.set_action(i, abstract_scaled_timer::generic_action(new sync_action(
+      [&events,i] {
+        ++events.counts[i];
+        ++events.total;
+        return true;
+      })));
+  }
+}
+
+// Returns the first sleep time before category is triggered. With one thread,
+// one timer, and a fixed seed, this is the same exponential draw divided by
+// the timer's lambda, so it can be used to compare lambdas.
+template <class Timer>
+double first_sleep(Timer &timer, int category) {
+  double sleep = 0;
+  timer.set_action(category, abstract_scaled_timer::generic_action(new sync_action(
+    [&timer,&sleep] {
+      sleep = last_sleep;
+      timer.async_stop();
+      return true;
+    })));
+  timer.start();
+  timer.wait_stopping();
+  timer.stop();
+  return sleep;
+}
+
+}  // namespace
+
+TEST(action_timer_test, counter_based_reproducible) {
+  // The serial run is longer, since with 3 threads, events can be triggered
+  // slightly out of order.
+  std::vector <std::pair <double, int>> serial = record_events(1, 4000, false);
+  // Snapshot sampling would break reproducibility, so it's ignored.
+  const std::vector <std::pair <double, int>> parallel = record_events(3, 2000, true);
+  std::sort(serial.begin(), serial.end());
+  for (const auto &event : parallel) {
+    // Each event's exponential draw identifies it, since they're all distinct.
+    auto found = std::lower_bound(serial.begin(), serial.end(),
+                                  std::make_pair(event.first * (1 - 1e-12), -1));
+    ASSERT_TRUE(found != serial.end());
+    ASSERT_NEAR(event.first, found->first, 1e-12 * event.first);
+    EXPECT_EQ(found->second, event.second);
+  }
+}
+
+TEST(action_timer_test, replace_action_while_triggering) {
+  action_timer <int> timer(3, [] { return new null_timer; });
+  timer.set_timer(0, 1.0);
+  timer.start();
+  for (int i = 0; i < 20; ++i) {
+    trigger_state old_state, new_state;
+    timer.set_action(0, make_slow_action(old_state));
+    while (!old_state.started) {
+      std::this_thread::yield();
+    }
+    timer.set_action(0, make_slow_action(new_state));
+    // The old action must be finished, e.g., so that whatever it refers to can
+    // be destructed now.
+    EXPECT_EQ(0, old_state.running);
+    old_state.removed = true;
+
+    while (!new_state.started) {
+      std::this_thread::yield();
+    }
+    timer.erase_action(0);
+    EXPECT_EQ(0, new_state.running);
+    new_state.removed = true;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    EXPECT_EQ(0, old_state.late);
+    EXPECT_EQ(0, new_state.late);
+  }
+  timer.stop();
+}
+
+TEST(action_timer_test, handle_generations) {
+  action_timer <int> timer(1, [] { return new null_timer; });
+  // Generations start at 1, so a default handle is never valid.
+  EXPECT_FALSE(timer.handle_exists(action_timer <int> ::handle()));
+
+  const auto first = timer.get_handle(1);
+  EXPECT_TRUE(timer.handle_exists(first));
+  EXPECT_NE(0, first.generation);
+  const auto same = timer.get_handle(1);
+  EXPECT_EQ(first.index, same.index);
+  EXPECT_EQ(first.generation, same.generation);
+
+  EXPECT_TRUE(timer.set_rate(first, 2.0));
+  EXPECT_TRUE(timer.set_action(first, abstract_scaled_timer::generic_action(
+    new sync_action([] { return true; }))));
+  EXPECT_TRUE(timer.timer_exists(1));
+  EXPECT_TRUE(timer.action_exists(1));
+
+  timer.erase(first);
+  EXPECT_FALSE(timer.handle_exists(first));
+  EXPECT_FALSE(timer.timer_exists(1));
+  EXPECT_FALSE(timer.action_exists(1));
+
+  // The index is reused with a new generation, and the stale handle doesn't
+  // refer to the new category.
+  const auto second = timer.get_handle(2);
+  EXPECT_EQ(first.index, second.index);
+  EXPECT_NE(first.generation, second.generation);
+  EXPECT_TRUE(timer.handle_exists(second));
+  EXPECT_FALSE(timer.handle_exists(first));
+  EXPECT_FALSE(timer.set_rate(first, 1.0));
+  EXPECT_FALSE(timer.set_action(first, abstract_scaled_timer::generic_action(
+    new sync_action([] { return true; }))));
+  EXPECT_FALSE(timer.timer_exists(2));
+  EXPECT_FALSE(timer.action_exists(2));
+  // Erasing with the stale handle does nothing.
+  EXPECT_TRUE(timer.set_rate(second, 1.0));
+  timer.erase(first);
+  EXPECT_TRUE(timer.handle_exists(second));
+  EXPECT_TRUE(timer.timer_exists(2));
+
+  // Recreating an erased category doesn't revive its old handle.
+  const auto third = timer.get_handle(1);
+  EXPECT_NE(first.index, third.index);
+  EXPECT_FALSE(timer.handle_exists(first));
+}
+
+// Waits in its destructor until another update has been attempted, so that
+// erase gives a concurrent update every chance to get between its steps.
+class waiting_action : public abstract_action {
+public:
+  waiting_action(std::atomic <bool> &new_destructing, std::atomic <bool> &new_updated) :
+  destructing(new_destructing), updated(new_updated) {}
+
+  void start() override {}
+  bool trigger_action() override { return true; }
+
+  ~waiting_action() override {
+    destructing = true;
+    while (!updated) {
+      std::this_thread::yield();
+    }
+  }
+
+private:
+  std::atomic <bool> &destructing, &updated;
+};
+
+TEST(action_timer_test, erase_handle_while_updating) {
+  action_timer <int> timer(1, [] { return new null_timer; });
+  for (int i = 0; i < 10; ++i) {
+    const auto category = timer.get_handle(i);
+    std::atomic <bool> destructing(false), updated(false), erased(false);
+    timer.set_action(category, abstract_scaled_timer::generic_action(
+      new waiting_action(destructing, updated)));
+    std::thread updater([&timer,&category,&destructing,&updated,&erased] {
+      while (!erased) {
+        const bool after = destructing;
+        timer.set_rate(category, 1.0);
+        if (after) {
+          updated = true;
+        }
+      }
+    });
+    timer.erase(category);
+    // Once erase returns, the handle can't be used to recreate anything.
+    EXPECT_FALSE(timer.handle_exists(category));
+    erased = true;
+    updater.join();
+    EXPECT_FALSE(timer.handle_exists(category));
+    EXPECT_FALSE(timer.timer_exists(i));
+    EXPECT_FALSE(timer.action_exists(i));
+  }
+}
+
+TEST(action_timer_test, set_timers_repeated_category) {
+  typedef std::vector <std::pair <int, double>> batch_type;
+  const batch_type batch{ { 5, 1.0 }, { 5, 2.0 } };
+
+  action_timer <int> first(1, [] { return new recording_timer; }, 7);
+  // Without overwrite, only the first is set, the same as calling set_timer
+  // for each.
+  EXPECT_EQ(1, first.set_timers(batch.begin(), batch.end(), false));
+  EXPECT_EQ(0, first.set_timers(batch.begin(), batch.end(), false));
+  action_timer <int> first_expected(1, [] { return new recording_timer; }, 7);
+  first_expected.set_timer(5, 1.0);
+  const double first_sleep_expected = first_sleep(first_expected, 5);
+  EXPECT_EQ(first_sleep_expected, first_sleep(first, 5));
+
+  // With overwrite, the last one is kept.
+  action_timer <int> last(1, [] { return new recording_timer; }, 7);
+  EXPECT_EQ(2, last.set_timers(batch.begin(), batch.end(), true));
+  action_timer <int> last_expected(1, [] { return new recording_timer; }, 7);
+  last_expected.set_timer(5, 2.0);
+  const double last_sleep_expected = first_sleep(last_expected, 5);
+  EXPECT_EQ(last_sleep_expected, first_sleep(last, 5));
+  EXPECT_EQ(first_sleep_expected, 2 * last_sleep_expected);
+}
+
+TEST(action_timer_test, set_timers_full_with_repeated_category) {
+  typedef action_timer <int, double, small_category_tables <2> ::type> timer_type;
+  timer_type timer(1, [] { return new null_timer; });
+  EXPECT_TRUE(timer.set_timer(1, 1.0));
+  EXPECT_TRUE(timer.set_timer(2, 1.0));
+
+  // The table is full, so both entries for 3 are rejected.
+  const std::vector <std::pair <int, double>> batch{ { 3, 1.0 }, { 3, 2.0 } };
+  EXPECT_EQ(0, timer.set_timers(batch.begin(), batch.end()));
+  EXPECT_FALSE(timer.timer_exists(3));
+
+  // If the slot for 3 were released twice, its index would be handed out
+  // twice here.
+  const auto first  = timer.get_handle(10);
+  const auto second = timer.get_handle(11);
+  EXPECT_NE(first.index, second.index);
+  EXPECT_TRUE(timer.handle_exists(first));
+  EXPECT_TRUE(timer.handle_exists(second));
+  timer.erase(first);
+  EXPECT_FALSE(timer.handle_exists(first));
+  EXPECT_TRUE(timer.handle_exists(second));
+}
+
+TEST(action_timer_test, action_returning_false_is_removed) {
+  action_timer <int> timer(1, [] { return new null_timer; });
+  std::atomic <int> triggered(0);
+  timer.set_timer(1, 1.0);
+  timer.set_action(1, abstract_scaled_timer::generic_action(new sync_action(
+    [&triggered] {
+      ++triggered;
+      return false;
+    })));
+  timer.start();
+  while (timer.timer_exists(1) || timer.action_exists(1)) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(1, triggered);
+
+  // Creating the category again gives it a new slot, which isn't affected.
+  std::atomic <bool> retriggered(false);
+  timer.set_timer(1, 1.0);
+  timer.set_action(1, abstract_scaled_timer::generic_action(new sync_action(
+    [&retriggered] {
+      retriggered = true;
+      return true;
+    })));
+  while (!retriggered) {
+    std::this_thread::yield();
+  }
+  timer.stop();
+  EXPECT_EQ(1, triggered);
+  EXPECT_TRUE(timer.timer_exists(1));
+  EXPECT_TRUE(timer.action_exists(1));
+}
+
+TEST(action_timer_test, lock_free_sampling_follows_updates) {
+  const unsigned int threads = 3;
+  action_timer <int> timer(threads, [] { return new null_timer; });
+  event_counts events;
+  set_counting_actions(timer, events);
+  timer.set_lock_free_sampling(true);
+  timer.set_timer(0, 1.0);
+  timer.set_timer(1, 1.0);
+  timer.start();
+  events.wait_for(1000);
+  EXPECT_GT(events.counts[0], 0);
+
+  // Each thread might already have drawn 0 for its current event, but nothing
+  // after that.
+  timer.erase_timer(0);
+  const long erased = events.counts[0];
+  events.wait_for(10000);
+  EXPECT_LE(events.counts[0] - erased, threads);
+
+  // The whole batch is seen at once, so 1 becomes rare right away.
+  const std::vector <std::pair <int, double>> batch{ { 1, 1.0 }, { 2, 1000.0 } };
+  timer.set_timers(batch.begin(), batch.end());
+  const long before_rare  = events.counts[1];
+  const long before_total = events.total;
+  events.wait_for(20000);
+  const long rare  = events.counts[1] - before_rare;
+  const long total = events.total - before_total;
+  // About 1 in 1001 is expected, plus events that were already drawn.
+  EXPECT_LT(rare, 3 * total / 1000 + threads + 20);
+  timer.stop();
+}
+
+TEST(action_timer_test, lock_free_sampling_toggled_while_running) {
+  const unsigned int threads = 3;
+  action_timer <int> timer(threads, [] { return new null_timer; });
+  event_counts events;
+  set_counting_actions(timer, events);
+  timer.set_timer(0, 1.0);
+  timer.start();
+  for (int i = 0; i < 100; ++i) {
+    timer.set_lock_free_sampling(i % 2 == 0);
+    // Updates are applied to whichever mode is active, and each mode has to
+    // start from the current timers.
+    timer.set_timer(1 + i % 3, 1.0);
+    timer.erase_timer(1 + (i + 1) % 3);
+    events.wait_for(10);
+  }
+  timer.set_lock_free_sampling(true);
+  const std::vector <int> erased{ 1, 2, 3 };
+  timer.erase_timers(erased.begin(), erased.end());
+  long before[event_counts::categories];
+  for (int i = 0; i < event_counts::categories; ++i) {
+    before[i] = events.counts[i];
+  }
+  events.wait_for(5000);
+  for (int i = 1; i < event_counts::categories; ++i) {
+    EXPECT_LE(events.counts[i] - before[i], threads);
+  }
+
+  timer.set_lock_free_sampling(false);
+  timer.set_timer(3, 1.0);
+  timer.erase_timer(0);
+  const long before_3 = events.counts[3];
+  events.wait_for(1000);
+  EXPECT_GT(events.counts[3] - before_3, 900);
+  timer.stop();
+}
+
+TEST(action_timer_test, lock_free_sampling_waits_when_empty) {
+  action_timer <int> timer(2, [] { return new null_timer; });
+  event_counts events;
+  set_counting_actions(timer, events);
+  timer.set_lock_free_sampling(true);
+  // With no timers, the threads have to wait rather than sample.
+  timer.start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_EQ(0, events.total);
+
+  // Setting a timer wakes the threads up.
+  timer.set_timer(0, 1.0);
+  events.wait_for(1000);
+
+  // Once empty again, they go back to waiting, and stop still wakes them.
+  timer.erase_timer(0);
+  const long erased = events.total;
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_LE(events.total - erased, 2);
+  timer.set_timer(1, 1.0);
+  events.wait_for(1000);
+  timer.erase_timer(1);
+  timer.stop();
+  EXPECT_TRUE(timer.is_stopped());
+}
+
+TEST(action_timer_test, snapshot_sampling_follows_erase) {
+  const unsigned int threads = 2;
+  // NOTE: Snapshot sampling is ignored with counter-based generators.
+  action_timer <int, double, category_tree, std::mt19937> timer(threads, [] { return new null_timer; });
+  event_counts events;
+  set_counting_actions(timer, events);
+  timer.set_snapshot_sampling(true);
+  for (int i = 0; i < event_counts::categories; ++i) {
+    timer.set_timer(i, 1.0);
+  }
+  timer.start();
+  // The snapshot is only built once enough events have come from the timers.
+  while (!std::atomic_load(&timer.snapshot)) {
+    std::this_thread::yield();
+  }
+  events.wait_for(1000);
+  for (int i = 0; i < event_counts::categories; ++i) {
+    EXPECT_GT(events.counts[i], 0);
+  }
+
+  // The old snapshot is discarded, and the next one doesn't include 0.
+  timer.erase_timer(0);
+  const long erased = events.counts[0];
+  events.wait_for(1000);
+  const auto rebuilt = std::atomic_load(&timer.snapshot);
+  ASSERT_TRUE(rebuilt);
+  EXPECT_EQ(event_counts::categories - 1, rebuilt->category_count());
+  events.wait_for(1000);
+  EXPECT_LE(events.counts[0] - erased, threads);
+
+  timer.set_snapshot_sampling(false);
+  EXPECT_FALSE(std::atomic_load(&timer.snapshot));
+  events.wait_for(1000);
+  EXPECT_FALSE(std::atomic_load(&timer.snapshot));
+  timer.stop();
+}
+
+int main(int argc, char *argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
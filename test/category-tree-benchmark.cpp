@@ -0,0 +1,461 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+// Usage: category-tree-benchmark [section...] [category count...]
+// With no sections, all of them are run. With no counts, 1K, 1M and 10M
+// categories are used, except for "small", which uses 4 to 64. (For "drift", the count is the number of updates; e.g.,
+// "category-tree-benchmark drift 100000000" checks 10^8 updates.)
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "arena-category-tree.hpp"
+#include "category-interner.hpp"
+#include "category-tree.hpp"
+#include "compensated-size.hpp"
+#include "persistent-category-tree.hpp"
+#include "small-category-table.hpp"
+#include "wide-category-tree.hpp"
+
+namespace {
+
+// Keeps results "used" so that the optimizer can't discard the timed work.
+volatile long benchmark_sink = 0;
+
+template <class Function>
+double ns_per_op(std::size_t count, const Function &function) {
+  const auto start = std::chrono::steady_clock::now();
+  function();
+  const auto finish = std::chrono::steady_clock::now();
+  return std::chrono::duration <double, std::nano> (finish - start).count() / count;
+}
+
+std::vector <int> shuffled_keys(std::size_t count, std::default_random_engine &generator) {
+  std::vector <int> keys(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    keys[i] = i;
+  }
+  std::shuffle(keys.begin(), keys.end(), generator);
+  return keys;
+}
+
+template <class Tree>
+void prepare_locate(Tree &tree) {}
+
+template <class Category, class Size, class Weight>
+void prepare_locate(arena_category_tree <Category, Size, Weight> &tree) {
+  tree.compact();
+}
+
+template <class Tree>
+void benchmark_layout(const char *label, std::size_t count, bool compact = false) {
+  std::default_random_engine generator(count);
+  std::uniform_real_distribution <double> uniform;
+  std::vector <int> keys = shuffled_keys(count, generator);
+  std::unique_ptr <Tree> tree(new Tree);
+
+  const double insert_ns = ns_per_op(count, [&] {
+    for (int key : keys) {
+      tree->update_category(key, 1.0 + key % 7);
+    }
+  });
+
+  if (compact) {
+    prepare_locate(*tree);
+  }
+
+  std::vector <double> positions(count);
+  for (double &position : positions) {
+    position = uniform(generator) * tree->get_total_size();
+  }
+  const double locate_ns = ns_per_op(count, [&] {
+    long sum = 0;
+    for (double position : positions) {
+      sum += tree->locate(position);
+    }
+    benchmark_sink = sum;
+  });
+
+  std::shuffle(keys.begin(), keys.end(), generator);
+  const double erase_ns = ns_per_op(count, [&] {
+    for (int key : keys) {
+      tree->erase_category(key);
+    }
+  });
+
+  printf("%-8s %10zu %10.1f %10.1f %10.1f\n", label, count, insert_ns, locate_ns, erase_ns);
+}
+
+void layout_section(std::size_t count) {
+  benchmark_layout <category_tree <int, double>>       ("linked", count);
+  benchmark_layout <arena_category_tree <int, double>> ("arena",  count);
+  benchmark_layout <arena_category_tree <int, double>> ("compact", count, true);
+  benchmark_layout <arena_category_tree <int, double, float>> ("compact32", count, true);
+  benchmark_layout <persistent_category_tree <int, double>> ("persist", count);
+  benchmark_layout <wide_category_tree <int, double, 8>>  ("wide8",  count);
+  benchmark_layout <wide_category_tree <int, double, 16>> ("wide16", count);
+  benchmark_layout <wide_category_tree <int, double, 32>> ("wide32", count);
+}
+
+void assign_section(std::size_t count) {
+  std::default_random_engine generator(count);
+  std::vector <std::pair <int, double>> sorted;
+  for (int key : shuffled_keys(count, generator)) {
+    sorted.emplace_back(key, 1.0 + key % 7);
+  }
+  std::vector <std::pair <int, double>> unsorted(sorted);
+  std::sort(sorted.begin(), sorted.end());
+
+  std::unique_ptr <category_tree <int, double>> tree(new category_tree <int, double>);
+  const double update_ns = ns_per_op(count, [&] {
+    for (const auto &category : unsorted) {
+      tree->update_category(category.first, category.second);
+    }
+  });
+  tree.reset(new category_tree <int, double>);
+  const double sorted_ns = ns_per_op(count, [&] {
+    tree->assign(sorted.begin(), sorted.end());
+  });
+  tree.reset(new category_tree <int, double>);
+  const double unsorted_ns = ns_per_op(count, [&] {
+    tree->assign(unsorted.begin(), unsorted.end());
+  });
+
+  printf("%-8s %10zu %10.1f %10.1f %11.1f\n", "linked", count, update_ns, sorted_ns, unsorted_ns);
+}
+
+void operations_section(std::size_t count) {
+  std::default_random_engine generator(count);
+  std::uniform_real_distribution <double> uniform;
+  const std::vector <int> keys = shuffled_keys(count, generator);
+  std::vector <std::pair <int, double>> sorted;
+  for (std::size_t i = 0; i < count; ++i) {
+    sorted.emplace_back(i, 1.0 + i % 7);
+  }
+  category_tree <int, double> tree(sorted.begin(), sorted.end());
+
+  const double update_ns = ns_per_op(count, [&] {
+    for (int key : keys) {
+      tree.update_category(key, 2.0 + key % 5);
+    }
+  });
+  const double callable_ns = ns_per_op(count, [&] {
+    for (int key : keys) {
+      tree.update_category(key, [](double size) { return size + 1.0; });
+    }
+  });
+  const double size_ns = ns_per_op(count, [&] {
+    double sum = 0;
+    for (int key : keys) {
+      sum += tree.category_size(key);
+    }
+    benchmark_sink = sum;
+  });
+  std::vector <double> positions(count);
+  for (double &position : positions) {
+    position = uniform(generator) * tree.get_total_size();
+  }
+  const double locate_ns = ns_per_op(count, [&] {
+    long sum = 0;
+    for (double position : positions) {
+      sum += tree.locate(position);
+    }
+    benchmark_sink = sum;
+  });
+
+  printf("%-8s %10zu %10.1f %11.1f %10.1f %10.1f\n", "linked", count,
+         update_ns, callable_ns, size_ns, locate_ns);
+}
+
+// Applies count random updates to 1000 categories, returning the worst error
+// in the total seen at 100 checkpoints, in units of epsilon * exact total.
+template <class Size>
+double worst_drift(std::size_t count, double &update_ns) {
+  const int category_count = 1000;
+  std::default_random_engine generator(count);
+  std::uniform_int_distribution <int> category_choice(0, category_count - 1);
+  std::uniform_real_distribution <double> exponent(-20, 20);
+  category_tree <int, Size> tree;
+  std::vector <double> sizes(category_count, 0.0);
+  const std::size_t checkpoint = std::max <std::size_t> (count / 100, 1);
+  double worst_error = 0;
+  update_ns = 0;
+  for (std::size_t done = 0; done < count; done += checkpoint) {
+    const std::size_t batch = std::min(checkpoint, count - done);
+    update_ns += ns_per_op(count, [&] {
+      for (std::size_t i = 0; i < batch; ++i) {
+        const int category = category_choice(generator);
+        sizes[category] = std::exp(exponent(generator));
+        tree.update_category(category, sizes[category]);
+      }
+    });
+    long double exact = 0, error = 0;
+    for (double size : sizes) {
+      const long double new_exact = exact + size;
+      error += (std::abs(exact) >= size)? (exact - new_exact) + size : (size - new_exact) + exact;
+      exact = new_exact;
+    }
+    exact += error;
+    const double actual = static_cast <double> (tree.get_total_size());
+    worst_error = std::max(worst_error, (double) (std::abs(actual - exact) / exact) /
+                                        std::numeric_limits <double> ::epsilon());
+  }
+  return worst_error;
+}
+
+void drift_section(std::size_t count) {
+  double plain_ns = 0, compensated_ns = 0;
+  const double plain_error = worst_drift <double> (count, plain_ns);
+  const double compensated_error = worst_drift <compensated_size <double>> (count, compensated_ns);
+  printf("%-8s %10zu %10.2f %10.1f %10.2f %10.1f\n", "linked", count,
+         plain_error, plain_ns, compensated_error, compensated_ns);
+}
+
+// Times updates and locates for a tree with count categories, returning the
+// ns per update and setting locate_ns.
+template <class Tree>
+double small_tree_ns(std::size_t count, double &locate_ns) {
+  const std::size_t op_count = 1000000;
+  std::default_random_engine generator(count);
+  std::uniform_real_distribution <double> uniform;
+  std::uniform_int_distribution <int> category_choice(0, count - 1);
+  Tree tree;
+  for (std::size_t i = 0; i < count; ++i) {
+    tree.update_category(i, 1.0 + i % 7);
+  }
+  std::vector <int> categories(op_count);
+  for (int &category : categories) {
+    category = category_choice(generator);
+  }
+  const double update_ns = ns_per_op(op_count, [&] {
+    for (int category : categories) {
+      tree.update_category(category, 1.0 + category % 5);
+    }
+  });
+  std::vector <double> positions(op_count);
+  for (double &position : positions) {
+    position = uniform(generator) * tree.get_total_size();
+  }
+  locate_ns = ns_per_op(op_count, [&] {
+    long sum = 0;
+    for (double position : positions) {
+      sum += tree.locate(position);
+    }
+    benchmark_sink = sum;
+  });
+  return update_ns;
+}
+
+void small_section(std::size_t count) {
+  if (count > 64) {
+    printf("%-8s %10zu (skipped; more than 64 categories)\n", "small", count);
+    return;
+  }
+  double small_locate = 0, linked_locate = 0, wide_locate = 0;
+  const double small_update  = small_tree_ns <small_category_table <int, double, 64>> (count, small_locate);
+  const double linked_update = small_tree_ns <category_tree <int, double>> (count, linked_locate);
+  const double wide_update   = small_tree_ns <wide_category_tree <int, double>> (count, wide_locate);
+  printf("%-8s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", "small", count,
+         small_update, small_locate, linked_update, linked_locate, wide_update, wide_locate);
+}
+
+// Bytes currently allocated from the heap, or 0 if that isn't available.
+std::size_t heap_bytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  const struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+template <class Category>
+Category make_key(std::size_t index);
+
+template <>
+int make_key <int> (std::size_t index) {
+  return index;
+}
+
+template <>
+std::string make_key <std::string> (std::size_t index) {
+  // Short enough for the small-string optimization in common implementations.
+  return "c" + std::to_string(index);
+}
+
+// Heap bytes per category for a tree with count categories, including the
+// allocator's overhead.
+template <class Tree, class Category = int>
+double bytes_per_category(std::size_t count, bool compact = false) {
+  const std::size_t before = heap_bytes();
+  std::unique_ptr <Tree> tree(new Tree);
+  for (std::size_t i = 0; i < count; ++i) {
+    tree->update_category(make_key <Category> ((i * 7919) % count), 1.0 + i % 7);
+  }
+  if (compact) {
+    prepare_locate(*tree);
+  }
+  return (double) (heap_bytes() - before) / count;
+}
+
+void memory_section(std::size_t count) {
+  printf("%-8s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", "bytes", count,
+         bytes_per_category <category_tree <int, double>> (count),
+         bytes_per_category <arena_category_tree <int, double>> (count, true),
+         bytes_per_category <arena_category_tree <int, double, float>> (count, true),
+         bytes_per_category <wide_category_tree <int, double>> (count),
+         bytes_per_category <persistent_category_tree <int, double>> (count),
+         bytes_per_category <category_tree <std::string, double>, std::string> (count),
+         bytes_per_category <arena_category_tree <std::string, double, float>, std::string> (count, true));
+}
+
+// The per-event work done by action_timer's timer threads: locate a category,
+// copy it, and then find its action in a map.
+template <class Category>
+double hot_loop_ns(const std::vector <Category> &categories, std::size_t op_count) {
+  std::default_random_engine generator(categories.size());
+  std::uniform_real_distribution <double> uniform;
+  category_tree <Category, double> tree;
+  std::map <Category, int> actions;
+  for (std::size_t i = 0; i < categories.size(); ++i) {
+    tree.update_category(categories[i], 1.0 + i % 7);
+    actions.emplace(categories[i], i);
+  }
+  std::vector <double> positions(op_count);
+  for (double &position : positions) {
+    position = uniform(generator) * tree.get_total_size();
+  }
+  return ns_per_op(op_count, [&] {
+    long sum = 0;
+    for (double position : positions) {
+      const Category category = tree.locate(position);
+      sum += actions.find(category)->second;
+    }
+    benchmark_sink = sum;
+  });
+}
+
+void intern_section(std::size_t count) {
+  const std::size_t op_count = 1000000;
+  // Long keys with a shared prefix, e.g., URLs, are the worst case for string
+  // comparisons.
+  std::vector <std::string> strings;
+  category_interner <std::string> interner;
+  std::vector <category_interner <std::string> ::id_type> ids;
+  for (std::size_t i = 0; i < count; ++i) {
+    strings.push_back("https://example.com/service/endpoint/" + std::to_string(i * 7919 % count));
+    ids.push_back(interner.intern(strings.back()));
+  }
+  const double intern_ns = ns_per_op(count, [&] {
+    long sum = 0;
+    for (const std::string &category : strings) {
+      sum += interner.intern(category);
+    }
+    benchmark_sink = sum;
+  });
+  printf("%-8s %10zu %10.1f %10.1f %10.1f\n", "linked", count,
+         hot_loop_ns(strings, op_count), hot_loop_ns(ids, op_count), intern_ns);
+}
+
+struct benchmark_section {
+  // Column headers following the label column.
+  const char *columns;
+  std::function <void(std::size_t)> run;
+  // Used instead of the usual counts when none are given.
+  std::vector <std::size_t> default_counts;
+};
+
+const std::map <std::string, benchmark_section> &all_sections() {
+  static const std::map <std::string, benchmark_section> sections {
+    { "assign", { "      count  update_ns  sorted_ns unsorted_ns", &assign_section } },
+    { "drift",  { "      count double_eps  double_ns   comp_eps    comp_ns", &drift_section } },
+    { "intern", { "      count string_ns     id_ns  intern_ns", &intern_section } },
+    { "layout", { "      count  insert_ns  locate_ns   erase_ns", &layout_section } },
+    { "memory", { "      count     linked      arena  arena_f32     wide16    persist str_linked  str_arena",
+                  &memory_section } },
+    { "operations", { "    count  update_ns callable_ns    size_ns  locate_ns", &operations_section } },
+    { "small", { "      count small_upd  small_loc linked_upd linked_loc   wide_upd   wide_loc",
+                 &small_section, { 4, 8, 16, 32, 64 } } },
+  };
+  return sections;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::vector <std::string> sections;
+  std::vector <std::size_t> counts;
+  for (int i = 1; i < argc; ++i) {
+    char *end = nullptr;
+    const unsigned long count = strtoul(argv[i], &end, 10);
+    if (*argv[i] && !*end) {
+      counts.push_back(count);
+    } else if (all_sections().count(argv[i])) {
+      sections.push_back(argv[i]);
+    } else {
+      fprintf(stderr, "%s: Unknown section \"%s\".\n", argv[0], argv[i]);
+      return 1;
+    }
+  }
+  if (sections.empty()) {
+    for (const auto &section : all_sections()) {
+      sections.push_back(section.first);
+    }
+  }
+  const std::vector <std::size_t> usual_counts = { 1000, 1000000, 10000000 };
+
+  for (const std::string &name : sections) {
+    const benchmark_section &section = all_sections().at(name);
+    printf("%-8s%s\n", name.c_str(), section.columns);
+    const std::vector <std::size_t> &section_counts =
+      !counts.empty()? counts :
+      !section.default_counts.empty()? section.default_counts : usual_counts;
+    for (std::size_t count : section_counts) {
+      section.run(count);
+    }
+    printf("\n");
+  }
+}
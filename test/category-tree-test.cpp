@@ -32,13 +32,30 @@ either expressed or implied, of the FreeBSD Project.
 #include <gtest/gtest.h>
 
 #define TESTING
+#include "alias-table.hpp"
+#include "arena-category-tree.hpp"
+#include "category-interner.hpp"
 #include "category-tree.hpp"
+#include "compensated-size.hpp"
+#include "decayed-category-tree.hpp"
+#include "persistent-category-tree.hpp"
+#include "philox-generator.hpp"
+#include "small-category-table.hpp"
+#include "wide-category-tree.hpp"
+#include "xoshiro-generator.hpp"
 #undef TESTING
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <random>
 #include <vector>
 #include <memory>
 #include <string>
+#include <thread>
 
 using string_node_type = category_node <std::string, int>;
 using num_node_type    = category_node <int, int>;
@@ -680,6 +697,1044 @@ TEST(category_tree_test, zero_size_test) {
   }
 }
 
+TEST(category_tree_test, assign_sorted) {
+  std::vector <std::pair <int, int>> sorted;
+  // Sizes that aren't powers of 2 exercise the uneven splits.
+  for (int element_count = 0; element_count < 100; ++element_count) {
+    category_tree <int, int> tree(sorted.begin(), sorted.end());
+    EXPECT_EQ(element_count, tree.get_total_size());
+    if (element_count == 0) {
+      EXPECT_EQ(nullptr, tree.root);
+    } else {
+      ASSERT_NE(nullptr, tree.root);
+      EXPECT_TRUE(tree.root->validate_balanced());
+      EXPECT_TRUE(tree.root->validate_sorted());
+      EXPECT_TRUE(tree.root->validate_sized());
+    }
+    for (int i = 0; i < element_count; ++i) {
+      EXPECT_EQ(i, tree.locate(i));
+    }
+    sorted.emplace_back(element_count, 1);
+  }
+  // Sorted, but not random-access.
+  const std::map <std::string, int> categories { { "A", 1 }, { "B", 2 }, { "C", 3 } };
+  category_tree <std::string, int> tree(categories.begin(), categories.end());
+  ASSERT_NE(nullptr, tree.root);
+  EXPECT_EQ(6, tree.get_total_size());
+  EXPECT_EQ(2, tree.category_size("B"));
+  EXPECT_TRUE(tree.root->validate_balanced());
+  EXPECT_TRUE(tree.root->validate_sorted());
+}
+
+TEST(category_tree_test, assign_unsorted) {
+  const int element_count = (1 << 8) + (1 << 7);
+  std::vector <std::pair <int, int>> unsorted;
+  for (int i = 0; i < element_count; ++i) {
+    unsorted.emplace_back(((i + 19) * 13) % element_count, 1);
+  }
+  // Repeated categories keep the last size.
+  unsorted.emplace_back(5, 3);
+  unsorted.emplace_back(7, 0);
+  unsorted.emplace_back(5, 2);
+  category_tree <int, int> tree;
+  tree.update_category(element_count, 100);
+  tree.assign(unsorted.begin(), unsorted.end());
+  ASSERT_NE(nullptr, tree.root);
+  EXPECT_TRUE(tree.root->validate_balanced());
+  EXPECT_TRUE(tree.root->validate_sorted());
+  EXPECT_TRUE(tree.root->validate_sized());
+  EXPECT_FALSE(tree.category_exists(element_count));
+  EXPECT_EQ(element_count, tree.get_total_size());
+  EXPECT_EQ(2, tree.category_size(5));
+  EXPECT_EQ(0, tree.category_size(7));
+  EXPECT_TRUE(tree.category_exists(7));
+}
+
+TEST(category_tree_test, update_categories_batch) {
+  const int element_count = (1 << 8) + (1 << 7);
+  category_tree <int, int> tree;
+  // Small batches relative to the tree size are applied individually, and
+  // large batches are merged; this covers both.
+  for (int batch_size : { element_count, 2, 3, 64 }) {
+    std::vector <std::pair <int, int>> batch;
+    for (int i = 0; i < batch_size; ++i) {
+      batch.emplace_back(((i + 19) * 13) % element_count, batch_size);
+    }
+    tree.update_categories(batch.begin(), batch.end());
+    ASSERT_NE(nullptr, tree.root);
+    EXPECT_TRUE(tree.root->validate_balanced());
+    EXPECT_TRUE(tree.root->validate_sorted());
+    EXPECT_TRUE(tree.root->validate_sized());
+    for (const auto &update : batch) {
+      EXPECT_EQ(batch_size, tree.category_size(update.first));
+    }
+  }
+  // The last update for a category wins.
+  const std::vector <std::pair <int, int>> repeated {
+    { 1, 5 }, { 0, 1 }, { 1, 7 }, { element_count, 3 }, { 0, 2 } };
+  tree.update_categories(repeated.begin(), repeated.end());
+  EXPECT_EQ(7, tree.category_size(1));
+  EXPECT_EQ(2, tree.category_size(0));
+  EXPECT_EQ(3, tree.category_size(element_count));
+}
+
+TEST(category_tree_test, erase_categories_batch) {
+  const int element_count = (1 << 8) + (1 << 7);
+  std::vector <std::pair <int, int>> categories;
+  for (int i = 0; i < element_count; ++i) {
+    categories.emplace_back(i, 1);
+  }
+  category_tree <int, int> tree(categories.begin(), categories.end());
+  const std::vector <int> few { 3, 1, element_count + 1 };
+  tree.erase_categories(few.begin(), few.end());
+  EXPECT_EQ(element_count - 2, tree.get_total_size());
+  EXPECT_FALSE(tree.category_exists(1));
+  EXPECT_FALSE(tree.category_exists(3));
+  std::vector <int> many;
+  for (int i = 0; i < element_count; i += 2) {
+    many.push_back(((i + 19) * 13) % element_count);
+  }
+  tree.erase_categories(many.begin(), many.end());
+  ASSERT_NE(nullptr, tree.root);
+  EXPECT_TRUE(tree.root->validate_balanced());
+  EXPECT_TRUE(tree.root->validate_sorted());
+  EXPECT_TRUE(tree.root->validate_sized());
+  for (int category : many) {
+    EXPECT_FALSE(tree.category_exists(category));
+  }
+  for (int i = 0; i < element_count; ++i) {
+    if (tree.category_exists(i)) tree.erase_category(i);
+  }
+  EXPECT_EQ(nullptr, tree.root);
+  tree.erase_categories(many.begin(), many.end());
+  EXPECT_EQ(nullptr, tree.root);
+}
+
+TEST(category_tree_test, locate_many_sorted) {
+  category_tree <int, int> tree;
+  const int element_count = (1 << 8) + (1 << 7);
+  for (int i = 0; i < element_count; ++i) {
+    const int adjusted = ((i + 19) * 13) % element_count;
+    // Every third category has zero size, and should never be located.
+    tree.update_category(adjusted, adjusted % 3);
+  }
+  std::vector <int> positions;
+  for (int i = 0; i < tree.get_total_size(); ++i) {
+    positions.push_back(i);
+    // Duplicate positions are allowed.
+    if (i % 5 == 0) positions.push_back(i);
+  }
+  std::vector <int> located;
+  tree.locate_many(positions.begin(), positions.end(), std::back_inserter(located));
+  ASSERT_EQ(positions.size(), located.size());
+  for (unsigned int i = 0; i < positions.size(); ++i) {
+    EXPECT_EQ(tree.locate(positions[i]), located[i]);
+    EXPECT_NE(0, located[i] % 3);
+  }
+}
+
+TEST(category_tree_test, locate_many_unsorted) {
+  category_tree <std::string, int> tree;
+  tree.update_category("B", 2);
+  tree.update_category("A", 1);
+  tree.update_category("D", 4);
+  tree.update_category("C", 3);
+  const std::vector <int> positions { 9, 0, 5, 3, 1, 9, 6, 2 };
+  std::vector <std::string> located(positions.size());
+  const auto end = tree.locate_many(positions.begin(), positions.end(), located.begin());
+  EXPECT_EQ(located.end(), end);
+  const std::vector <std::string> expected { "D", "A", "C", "C", "B", "D", "D", "B" };
+  EXPECT_EQ(expected, located);
+  std::vector <std::string> none;
+  tree.locate_many(positions.end(), positions.end(), std::back_inserter(none));
+  EXPECT_TRUE(none.empty());
+}
+
+TEST(category_tree_test, locate_many_benchmark) {
+  category_tree <int> tree;
+  const int element_count = 1 << 20;
+  for (int i = 0; i < element_count; ++i) {
+    tree.update_category(((i + 19) * 13) % element_count, 1.0 + i % 7);
+  }
+  // Sorted uniform draws, using normalized exponential spacings.
+  std::default_random_engine generator(element_count);
+  std::exponential_distribution <double> exponential;
+  std::vector <double> positions(element_count);
+  double cumulative = exponential(generator);
+  for (double &position : positions) {
+    position = cumulative;
+    cumulative += exponential(generator);
+  }
+  for (double &position : positions) {
+    position *= tree.get_total_size() / cumulative;
+  }
+
+  std::vector <int> single(positions.size()), batch(positions.size());
+  const auto single_start = std::chrono::steady_clock::now();
+  for (unsigned int i = 0; i < positions.size(); ++i) {
+    single[i] = tree.locate(positions[i]);
+  }
+  const auto batch_start = std::chrono::steady_clock::now();
+  tree.locate_many(positions.begin(), positions.end(), batch.begin());
+  const auto batch_finish = std::chrono::steady_clock::now();
+
+  const std::chrono::duration <double, std::nano> single_time = batch_start  - single_start;
+  const std::chrono::duration <double, std::nano> batch_time  = batch_finish - batch_start;
+  std::cerr << "locate:      " << single_time.count() / positions.size() << " ns/sample" << std::endl;
+  std::cerr << "locate_many: " << batch_time.count()  / positions.size() << " ns/sample" << std::endl;
+  EXPECT_EQ(single, batch);
+}
+
+TEST(category_tree_test, integer_sizes_exact) {
+  category_tree <int, uint64_t> tree;
+  std::map <int, uint64_t> expected;
+  std::default_random_engine generator(31);
+  std::uniform_int_distribution <int> category_choice(0, 999);
+  std::uniform_int_distribution <uint64_t> size_choice(1, uint64_t(1) << 40);
+  for (int i = 0; i < 100000; ++i) {
+    const int category = category_choice(generator);
+    if (i % 7 == 0) {
+      tree.erase_category(category);
+      expected.erase(category);
+    } else {
+      const uint64_t size = size_choice(generator);
+      tree.update_category(category, size);
+      expected[category] = size;
+    }
+  }
+  uint64_t expected_total = 0;
+  for (const auto &category : expected) {
+    expected_total += category.second;
+  }
+  // No drift, regardless of the number of updates.
+  EXPECT_EQ(expected_total, tree.get_total_size());
+  EXPECT_TRUE(tree.root->validate_sized());
+
+  // Boundaries between categories are exact.
+  uint64_t offset = 0;
+  for (const auto &category : expected) {
+    EXPECT_EQ(category.first, tree.locate(offset));
+    EXPECT_EQ(category.first, tree.locate(offset + category.second - 1));
+    offset += category.second;
+  }
+}
+
+TEST(category_tree_test, uniform_position) {
+  std::default_random_engine generator(17);
+
+  category_tree <int, uint64_t> integer_tree;
+  integer_tree.update_category(0, 1);
+  integer_tree.update_category(1, 3);
+  std::map <int, int> counts;
+  const int sample_count = 40000;
+  for (int i = 0; i < sample_count; ++i) {
+    const uint64_t position = integer_tree.uniform_position(generator);
+    ASSERT_GT(4, position);
+    ++counts[integer_tree.locate(position)];
+  }
+  EXPECT_NEAR(sample_count / 4, counts[0], sample_count / 100);
+  EXPECT_NEAR(3 * sample_count / 4, counts[1], sample_count / 100);
+
+  category_tree <int, double> real_tree;
+  real_tree.update_category(0, 1e300);
+  real_tree.update_category(1, 1e-300);
+  for (int i = 0; i < 1000; ++i) {
+    const double position = real_tree.uniform_position(generator);
+    ASSERT_LE(0.0, position);
+    ASSERT_GT(real_tree.get_total_size(), position);
+  }
+}
+
+TEST(category_tree_test, iteration_and_export) {
+  category_tree <int, int> tree;
+  EXPECT_TRUE(tree.begin() == tree.end());
+  const int element_count = 1000;
+  for (int i = 0; i < element_count; ++i) {
+    const int adjusted = ((i + 19) * 13) % element_count;
+    tree.update_category(2 * adjusted, adjusted % 5);
+  }
+  int expected = 0;
+  for (const auto &node : tree) {
+    EXPECT_EQ(2 * expected, node.get_category());
+    EXPECT_EQ(expected % 5, node.get_size());
+    ++expected;
+  }
+  EXPECT_EQ(element_count, expected);
+  EXPECT_EQ(element_count, std::distance(tree.begin(), tree.end()));
+
+  EXPECT_EQ(10, tree.lower_bound(10)->get_category());
+  EXPECT_EQ(12, tree.lower_bound(11)->get_category());
+  EXPECT_EQ(12, tree.upper_bound(10)->get_category());
+  EXPECT_EQ(0,  tree.lower_bound(-5)->get_category());
+  EXPECT_TRUE(tree.lower_bound(2 * element_count) == tree.end());
+  EXPECT_TRUE(tree.upper_bound(2 * element_count - 2) == tree.end());
+
+  // Export in chunks that don't evenly divide the tree.
+  std::vector <std::pair <int, int>> buffer(300);
+  std::vector <std::pair <int, int>> exported;
+  std::size_t copied = tree.export_categories(buffer.data(), buffer.size());
+  while (copied > 0) {
+    exported.insert(exported.end(), buffer.begin(), buffer.begin() + copied);
+    copied = tree.export_categories(tree.upper_bound(exported.back().first),
+                                    buffer.data(), buffer.size());
+  }
+  ASSERT_EQ(element_count, exported.size());
+  for (int i = 0; i < element_count; ++i) {
+    EXPECT_EQ(2 * i, exported[i].first);
+    EXPECT_EQ(i % 5, exported[i].second);
+  }
+}
+
+TEST(category_tree_test, range_queries) {
+  category_tree <int, int> tree;
+  const int element_count = 1000;
+  for (int i = 0; i < element_count; ++i) {
+    // Every third category is empty.
+    tree.update_category(2 * i, (i % 3 == 0)? 0 : i % 7 + 1);
+  }
+  std::default_random_engine generator(7);
+  std::uniform_int_distribution <int> bound(-10, 2 * element_count + 10);
+  for (int trial = 0; trial < 500; ++trial) {
+    int low = bound(generator), high = bound(generator);
+    if (high < low) std::swap(low, high);
+    int expected_total = 0;
+    std::vector <int> expected;
+    tree.for_each([&](int category, int size) {
+      if (category >= low && category < high) {
+        expected_total += size;
+        expected.insert(expected.end(), size, category);
+      }
+    });
+    ASSERT_EQ(expected_total, tree.total_size_in_range(low, high));
+    for (int i = 0; i < expected_total; ++i) {
+      ASSERT_EQ(expected[i], tree.locate_in_range(low, high, i));
+    }
+  }
+  EXPECT_EQ(tree.get_total_size(), tree.total_size_in_range(-1, 2 * element_count));
+  EXPECT_EQ(0, tree.total_size_in_range(5, 5));
+
+  category_tree <std::string> tenants;
+  tenants.update_category("a/x", 1);
+  tenants.update_category("b/x", 2);
+  tenants.update_category("b/y", 3);
+  tenants.update_category("c/x", 4);
+  EXPECT_EQ(5, tenants.total_size_in_range("b/", "b0"));
+  EXPECT_EQ("b/x", tenants.locate_in_range("b/", "b0", 1.5));
+  EXPECT_EQ("b/y", tenants.locate_in_range("b/", "b0", 2.5));
+}
+
+TEST(category_tree_test, split_and_join) {
+  const auto validate = [](const category_tree <int, int> &tree) {
+    return !tree.root || (tree.root->validate_balanced() &&
+                          tree.root->validate_sorted() &&
+                          tree.root->validate_sized());
+  };
+  const int element_count = 1000;
+  std::default_random_engine generator(11);
+  std::uniform_int_distribution <int> bound(-10, element_count + 10);
+  for (int trial = 0; trial < 100; ++trial) {
+    category_tree <int, int> tree;
+    for (int i = 0; i < element_count; ++i) {
+      tree.update_category(((i + 19) * 13) % element_count, i % 7 + 1);
+    }
+    int low = bound(generator), high = bound(generator);
+    if (high < low) std::swap(low, high);
+    int expected_total = 0;
+    tree.for_each([&](int category, int size) {
+      if (category >= low && category < high) expected_total += size;
+    });
+    const int total = tree.get_total_size();
+    category_tree <int, int> extracted = tree.extract_range(low, high);
+    ASSERT_TRUE(validate(tree));
+    ASSERT_TRUE(validate(extracted));
+    EXPECT_EQ(expected_total, extracted.get_total_size());
+    EXPECT_EQ(total - expected_total, tree.get_total_size());
+    extracted.for_each([&](int category, int) {
+      EXPECT_TRUE(category >= low && category < high);
+      EXPECT_FALSE(tree.category_exists(category));
+    });
+    // Moving a range to a tree of lower categories.
+    category_tree <int, int> other;
+    other.update_category(-100, 1);
+    other.join(extracted);
+    EXPECT_EQ(nullptr, extracted.root);
+    ASSERT_TRUE(validate(other));
+    EXPECT_EQ(expected_total + 1, other.get_total_size());
+  }
+
+  category_tree <int, int> tree;
+  for (int i = 0; i < element_count; ++i) {
+    tree.update_category(i, 1);
+  }
+  category_tree <int, int> high = tree.split(element_count / 3);
+  EXPECT_EQ(element_count / 3, tree.get_total_size());
+  EXPECT_EQ(element_count - element_count / 3, high.get_total_size());
+  EXPECT_EQ(element_count / 3, high.locate(0));
+  // Joining in either order restores the original tree.
+  high.join(tree);
+  EXPECT_EQ(nullptr, tree.root);
+  ASSERT_TRUE(validate(high));
+  for (int i = 0; i < element_count; ++i) {
+    EXPECT_EQ(i, high.locate(i));
+  }
+  // Trees of very different heights.
+  category_tree <int, int> single;
+  single.update_category(element_count, 5);
+  high.join(single);
+  ASSERT_TRUE(validate(high));
+  EXPECT_EQ(element_count + 5, high.get_total_size());
+  const category_tree <int, int> everything = high.split(-1);
+  EXPECT_EQ(nullptr, high.root);
+  EXPECT_EQ(element_count + 5, everything.get_total_size());
+
+  category_tree <int, int, count_augmentation> counted;
+  for (int i = 0; i < element_count; ++i) {
+    counted.update_category(i, 1);
+  }
+  category_tree <int, int, count_augmentation> tail = counted.split(400);
+  EXPECT_EQ(400, counted.size());
+  EXPECT_EQ(600, tail.size());
+  EXPECT_EQ(450, tail.nth(50));
+}
+
+TEST(category_tree_test, sample_distinct) {
+  category_tree <int, int> tree;
+  for (int i = 0; i < 4; ++i) {
+    tree.update_category(i, i + 1);
+  }
+  tree.update_category(4, 0);
+  std::default_random_engine generator(23);
+  std::map <std::pair <int, int>, int> pair_counts;
+  const int sample_count = 100000;
+  for (int i = 0; i < sample_count; ++i) {
+    std::vector <int> drawn;
+    tree.sample_distinct(2, generator, std::back_inserter(drawn));
+    ASSERT_EQ(2, drawn.size());
+    ASSERT_NE(drawn[0], drawn[1]);
+    ++pair_counts[std::make_pair(drawn[0], drawn[1])];
+  }
+  EXPECT_EQ(10, tree.get_total_size());
+  for (int first = 0; first < 4; ++first) {
+    for (int second = 0; second < 4; ++second) {
+      if (first == second) continue;
+      const double expected = (first + 1) / 10.0 * (second + 1) / (10.0 - (first + 1));
+      EXPECT_NEAR(expected, pair_counts[std::make_pair(first, second)] / (double) sample_count, 0.01);
+    }
+  }
+
+  // Zero-size categories are never drawn.
+  for (int i = 0; i < 1000; ++i) {
+    std::vector <int> drawn;
+    tree.weighted_permutation(generator, std::back_inserter(drawn));
+    ASSERT_EQ(4, drawn.size());
+    std::sort(drawn.begin(), drawn.end());
+    EXPECT_EQ(std::vector <int> ({ 0, 1, 2, 3 }), drawn);
+  }
+
+  category_tree <int, double> large_tree;
+  for (int i = 0; i < 10000; ++i) {
+    large_tree.update_category(i, 1.0 + (i % 13) / 7.0);
+  }
+  std::vector <int> drawn;
+  large_tree.weighted_permutation(generator, std::back_inserter(drawn));
+  EXPECT_EQ(10000, drawn.size());
+  std::sort(drawn.begin(), drawn.end());
+  EXPECT_TRUE(std::unique(drawn.begin(), drawn.end()) == drawn.end());
+
+  // Sizes spanning many orders of magnitude leave rounding residue in the
+  // remaining sizes, which must not cut the permutation short.
+  category_tree <int, double> mixed_tree;
+  for (int i = 0; i < 10000; ++i) {
+    mixed_tree.update_category(i, (i % 100 == 0)? 1e16 : 0.1 * (1 + i % 9));
+  }
+  drawn.clear();
+  mixed_tree.weighted_permutation(generator, std::back_inserter(drawn));
+  EXPECT_EQ(10000, drawn.size());
+}
+
+TEST(category_tree_test, augmented_queries) {
+  category_tree <int, int,
+                 category_augmentations <count_augmentation,
+                                         max_size_augmentation,
+                                         min_size_augmentation>> tree;
+  std::map <int, int> expected;
+  std::default_random_engine generator(3);
+  std::uniform_int_distribution <int> category_choice(0, 999);
+  std::uniform_int_distribution <int> size_choice(1, 1000000);
+  for (int round = 0; round < 5; ++round) {
+    for (int i = 0; i < 2000; ++i) {
+      const int category = category_choice(generator);
+      if (i % 4 == 0) {
+        tree.erase_category(category);
+        expected.erase(category);
+      } else {
+        const int size = size_choice(generator);
+        tree.update_category(category, size);
+        expected[category] = size;
+      }
+    }
+    // Batch operations rebuild the tree, which must also update the counts.
+    std::vector <std::pair <int, int>> batch;
+    for (int i = 0; i < 500; ++i) {
+      batch.emplace_back(category_choice(generator), size_choice(generator));
+      expected[batch.back().first] = batch.back().second;
+    }
+    tree.update_categories(batch.begin(), batch.end());
+
+    ASSERT_EQ(expected.size(), tree.size());
+    std::size_t index = 0;
+    std::vector <std::pair <int, int>> by_size;
+    for (const auto &category : expected) {
+      EXPECT_EQ(category.first, tree.nth(index));
+      EXPECT_EQ(index, tree.rank(category.first));
+      EXPECT_EQ(index + 1, tree.rank(category.first + 1));
+      by_size.emplace_back(category.second, category.first);
+      ++index;
+    }
+    EXPECT_EQ(expected.size(), tree.rank(1000));
+    std::sort(by_size.rbegin(), by_size.rend());
+    EXPECT_EQ(by_size.front().first, tree.category_size(tree.max_category()));
+    EXPECT_EQ(by_size.back().first,  tree.category_size(tree.min_category()));
+
+    std::vector <std::pair <int, int>> top;
+    tree.top_categories(10, std::back_inserter(top));
+    ASSERT_EQ(10, top.size());
+    for (int i = 0; i < 10; ++i) {
+      EXPECT_EQ(by_size[i].first, top[i].second);
+      EXPECT_EQ(expected[top[i].first], top[i].second);
+    }
+  }
+}
+
+template <class Size>
+double check_drift(int update_count, int category_count, int seed) {
+  category_tree <int, Size> tree;
+  std::vector <double> sizes(category_count, 0.0);
+  std::default_random_engine generator(seed);
+  std::uniform_int_distribution <int> category_choice(0, category_count - 1);
+  // Sizes span many orders of magnitude, which is the worst case.
+  std::uniform_real_distribution <double> exponent(-20, 20);
+  double worst_error = 0;
+  for (int i = 0; i < update_count; ++i) {
+    const int category = category_choice(generator);
+    sizes[category] = std::exp(exponent(generator));
+    tree.update_category(category, sizes[category]);
+    if ((i + 1) % (update_count / 10) == 0) {
+      // Compensated reference sum, in long double.
+      long double exact = 0, error = 0;
+      for (double size : sizes) {
+        const long double new_exact = exact + size;
+        error += (std::abs(exact) >= size)? (exact - new_exact) + size : (size - new_exact) + exact;
+        exact = new_exact;
+      }
+      exact += error;
+      const double actual = static_cast <double> (tree.get_total_size());
+      const double relative = std::abs(actual - exact) / exact / std::numeric_limits <double> ::epsilon();
+      worst_error = std::max(worst_error, relative);
+      // AVL trees have a height of at most about 1.44 * log2(n).
+      EXPECT_GE(2 * 1.45 * std::log2(category_count + 2), relative);
+    }
+  }
+  for (int i = 0; i < category_count; ++i) {
+    tree.erase_category(i);
+  }
+  // Emptiness is always exact.
+  EXPECT_TRUE(tree.get_total_size() == Size());
+  return worst_error;
+}
+
+TEST(category_tree_test, drift_bounded) {
+  const int update_count = 1000000;
+  // The error (in units of epsilon) shouldn't grow with the number of updates.
+  const double plain_error = check_drift <double> (update_count, 1000, 5);
+  const double compensated_error = check_drift <compensated_size <double>> (update_count, 1000, 5);
+  EXPECT_GE(1.0, compensated_error);
+  EXPECT_GE(plain_error + 1.0, compensated_error);
+
+  category_tree <int, compensated_size <double>> tree;
+  tree.update_category(0, 1e20);
+  tree.update_category(1, 1.0);
+  tree.update_category(2, 1e20);
+  // A plain double can't represent these; 1.0 is less than half an ulp.
+  EXPECT_EQ(1.0, (tree.get_total_size() - 2e20).value());
+  EXPECT_EQ(0, tree.locate(compensated_size <double> (1e20) - 0.5));
+  EXPECT_EQ(1, tree.locate(compensated_size <double> (1e20) + 0.5));
+  EXPECT_EQ(2, tree.locate(compensated_size <double> (1e20) + 1.5));
+}
+
+TEST(alias_table_test, matches_tree_distribution) {
+  category_tree <int> tree;
+  const int element_count = 97;
+  for (int i = 0; i < element_count; ++i) {
+    // Every fifth category has zero size, and should never be located.
+    tree.update_category(i, (i % 5) * (1.0 + i));
+  }
+  const alias_table <int> table(tree);
+  EXPECT_EQ(tree.get_total_size(), table.get_total_size());
+  EXPECT_EQ(element_count - (element_count + 4) / 5, table.category_count());
+  // A uniform grid of positions should be split between the categories in
+  // proportion to their sizes, to within the resolution of the grid.
+  const int grid_size = 1 << 20;
+  std::vector <int> counts(element_count);
+  for (int i = 0; i < grid_size; ++i) {
+    ++counts[table.locate(tree.get_total_size() * i / grid_size)];
+  }
+  for (int i = 0; i < element_count; ++i) {
+    EXPECT_NEAR(tree.category_size(i) / tree.get_total_size(),
+                (double) counts[i] / grid_size, 1e-4);
+  }
+}
+
+TEST(alias_table_test, single_category) {
+  category_tree <std::string> tree;
+  tree.update_category("A", 0.0);
+  tree.update_category("B", 3.0);
+  const alias_table <std::string> table(tree);
+  EXPECT_EQ(1, table.category_count());
+  EXPECT_EQ("B", table.locate(0.0));
+  EXPECT_EQ("B", table.locate(2.999));
+}
+
+TEST(arena_category_tree_test, integration_test) {
+  arena_category_tree <int, int> tree;
+  const int element_count = (1 << 8) + (1 << 7);
+  for (int i = 0; i < element_count; ++i) {
+    const int adjusted = ((i + 19) * 13) % element_count;
+    tree.update_category(adjusted, 2);
+    EXPECT_EQ(2 * (i + 1), tree.get_total_size());
+    // (Yes, this makes it quadratic...)
+    EXPECT_TRUE(tree.validate_tree());
+  }
+  EXPECT_EQ(2 * element_count, tree.get_total_size());
+  for (int i = 0; i < tree.get_total_size(); ++i) {
+    EXPECT_EQ(i / 2, tree.locate(i));
+  }
+  for (int i = 0; i < element_count; ++i) {
+    EXPECT_TRUE(tree.category_exists(i));
+    EXPECT_EQ(2, tree.category_size(i));
+  }
+  tree.update_category(7, [](int x) { return 3*x; });
+  EXPECT_EQ(6, tree.category_size(7));
+  tree.update_category(7, 2);
+  for (int i = 0; i < element_count; ++i) {
+    const int adjusted = ((i + 7) * 19) % element_count;
+    EXPECT_TRUE(tree.category_exists(adjusted));
+    tree.erase_category(adjusted);
+    EXPECT_EQ(2 * (element_count - (i + 1)), tree.get_total_size());
+    EXPECT_FALSE(tree.category_exists(adjusted));
+    // (Yes, this makes it quadratic...)
+    EXPECT_TRUE(tree.validate_tree());
+  }
+  EXPECT_EQ(0, tree.get_total_size());
+}
+
+TEST(arena_category_tree_test, slot_reuse_test) {
+  arena_category_tree <std::string, int> tree;
+  const int element_count = 100;
+  for (int i = 0; i < element_count; ++i) {
+    tree.update_category(std::to_string(i), 1);
+  }
+  EXPECT_EQ(element_count, tree.nodes.size());
+  for (int i = 0; i < element_count; i += 2) {
+    tree.erase_category(std::to_string(i));
+  }
+  EXPECT_TRUE(tree.validate_tree());
+  for (int i = 0; i < element_count / 2; ++i) {
+    tree.update_category("x" + std::to_string(i), 2);
+  }
+  // Every erased slot should have been reused.
+  EXPECT_EQ(element_count, tree.nodes.size());
+  EXPECT_TRUE(tree.validate_tree());
+  EXPECT_EQ(element_count / 2 * 3, tree.get_total_size());
+  EXPECT_FALSE(tree.category_exists("0"));
+  EXPECT_TRUE(tree.category_exists("1"));
+  EXPECT_TRUE(tree.category_exists("x0"));
+}
+
+TEST(arena_category_tree_test, compact_weights) {
+  arena_category_tree <std::string, double, float> tree;
+  const int element_count = 1000;
+  for (int i = 0; i < element_count; ++i) {
+    tree.update_category(std::to_string(i), 0.5f + i % 3);
+  }
+  tree.compact();
+  EXPECT_TRUE(tree.validate_tree());
+  double expected_total = 0;
+  tree.for_each([&expected_total](const std::string &category, double size) {
+    EXPECT_EQ(0.5 + std::stoi(category) % 3, size);
+    expected_total += size;
+  });
+  EXPECT_EQ(expected_total, tree.get_total_size());
+  EXPECT_EQ(1.5, tree.category_size("7"));
+  tree.update_category("7", [](double size) { return size * 2; });
+  EXPECT_EQ(3.0, tree.category_size("7"));
+  EXPECT_EQ("0", tree.locate(0.25));
+  // Keys are stored out of line, so the nodes are the same for any Category.
+  EXPECT_EQ(element_count * (sizeof(tree.nodes[0]) + sizeof(std::string)), tree.arena_bytes());
+  EXPECT_GE(24, sizeof(tree.nodes[0]));
+}
+
+TEST(persistent_category_tree_test, integration_test) {
+  persistent_category_tree <int, int> tree;
+  const int element_count = (1 << 8) + (1 << 7);
+  for (int i = 0; i < element_count; ++i) {
+    const int adjusted = ((i + 19) * 13) % element_count;
+    tree.update_category(adjusted, 2);
+    EXPECT_EQ(2 * (i + 1), tree.get_total_size());
+    // (Yes, this makes it quadratic...)
+    EXPECT_LE(0, tree.validate_node(tree.get_version().root.get()));
+  }
+  EXPECT_EQ(2 * element_count, tree.get_total_size());
+  for (int i = 0; i < tree.get_total_size(); ++i) {
+    EXPECT_EQ(i / 2, tree.locate(i));
+  }
+  for (int i = 0; i < element_count; ++i) {
+    EXPECT_TRUE(tree.category_exists(i));
+    EXPECT_EQ(2, tree.category_size(i));
+  }
+  tree.update_category(7, [](int x) { return 3*x; });
+  EXPECT_EQ(6, tree.category_size(7));
+  tree.update_category(7, 2);
+  tree.erase_category(element_count);
+  EXPECT_EQ(2 * element_count, tree.get_total_size());
+  for (int i = 0; i < element_count; ++i) {
+    const int adjusted = ((i + 7) * 19) % element_count;
+    EXPECT_TRUE(tree.category_exists(adjusted));
+    tree.erase_category(adjusted);
+    EXPECT_EQ(2 * (element_count - (i + 1)), tree.get_total_size());
+    EXPECT_FALSE(tree.category_exists(adjusted));
+    // (Yes, this makes it quadratic...)
+    EXPECT_LE(0, tree.validate_node(tree.get_version().root.get()));
+  }
+  EXPECT_EQ(0, tree.get_total_size());
+  tree.update_category(1, 2);
+  tree.clear();
+  EXPECT_FALSE(tree.category_exists(1));
+  EXPECT_EQ(0, tree.get_total_size());
+}
+
+TEST(persistent_category_tree_test, path_copying) {
+  typedef persistent_category_tree <int, int> tree_type;
+  tree_type tree;
+  const int element_count = 1 << 10;
+  for (int i = 0; i < element_count; ++i) {
+    tree.update_category(i, 1);
+  }
+  tree_type::version old_version = tree.get_version();
+  std::weak_ptr <const void> old_root(old_version.root);
+  tree.update_category(element_count / 3, 5);
+
+  // The old version is unaffected.
+  EXPECT_EQ(1, old_version.category_size(element_count / 3));
+  EXPECT_EQ(element_count, old_version.get_total_size());
+  EXPECT_EQ(5, tree.category_size(element_count / 3));
+  EXPECT_EQ(element_count + 4, tree.get_total_size());
+
+  // Only the path to the category is copied; the rest is shared.
+  const tree_type::version new_version = tree.get_version();
+  int node_count = 0, copied_count = 0;
+  std::vector <const tree_type::tree_node*> pending{ new_version.root.get() };
+  while (!pending.empty()) {
+    const tree_type::tree_node *const current = pending.back();
+    pending.pop_back();
+    if (!current) continue;
+    ++node_count;
+    if (tree_type::find_node(old_version.root.get(), current->category) != current) {
+      ++copied_count;
+    }
+    pending.push_back(current->low_child.get());
+    pending.push_back(current->high_child.get());
+  }
+  EXPECT_EQ(element_count, node_count);
+  EXPECT_LE(1, copied_count);
+  EXPECT_GE(new_version.root->height, copied_count);
+
+  // The old version is reclaimed once nothing references it.
+  EXPECT_FALSE(old_root.expired());
+  old_version = tree_type::version();
+  EXPECT_TRUE(old_root.expired());
+}
+
+TEST(persistent_category_tree_test, concurrent_readers) {
+  persistent_category_tree <int, int> tree;
+  const int element_count = 1 << 8;
+  for (int i = 0; i < element_count; ++i) {
+    tree.update_category(i, 1);
+  }
+  std::atomic <bool> done(false);
+  std::atomic <int> failures(0);
+  std::vector <std::thread> readers;
+  for (int i = 0; i < 2; ++i) {
+    readers.emplace_back([&] {
+      while (!done) {
+        const auto version = tree.get_version();
+        int total = 0;
+        version.for_each([&total](int, int size) { total += size; });
+        if (total != version.get_total_size() ||
+            version.locate(total - 1) != element_count - 1) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (int i = 0; i < 1 << 14; ++i) {
+    tree.update_category(i % element_count, 1 + i % 5);
+  }
+  done = true;
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(0, failures);
+}
+
+TEST(small_category_table_test, integration_test) {
+  small_category_table <int, int, 64> table;
+  const int element_count = 64;
+  for (int i = 0; i < element_count; ++i) {
+    const int adjusted = ((i + 19) * 13) % element_count;
+    EXPECT_TRUE(table.update_category(adjusted, 2));
+    EXPECT_EQ(2 * (i + 1), table.get_total_size());
+  }
+  // Full, but existing categories can still be updated.
+  EXPECT_FALSE(table.update_category(element_count, 2));
+  EXPECT_FALSE(table.category_exists(element_count));
+  EXPECT_EQ(2 * element_count, table.get_total_size());
+  for (int i = 0; i < table.get_total_size(); ++i) {
+    EXPECT_EQ(i / 2, table.locate(i));
+  }
+  EXPECT_TRUE(table.update_category(7, [](int x) { return 3*x; }));
+  EXPECT_EQ(6, table.category_size(7));
+  EXPECT_TRUE(table.update_category(7, 0));
+  EXPECT_EQ(6, table.locate(13));
+  EXPECT_EQ(8, table.locate(14));
+  table.update_category(7, 2);
+  for (int i = 0; i < element_count; ++i) {
+    const int adjusted = ((i + 7) * 19) % element_count;
+    EXPECT_TRUE(table.category_exists(adjusted));
+    table.erase_category(adjusted);
+    EXPECT_EQ(2 * (element_count - (i + 1)), table.get_total_size());
+    EXPECT_FALSE(table.category_exists(adjusted));
+    int expected = 0;
+    table.for_each([&expected](int, int size) { expected += size; });
+    EXPECT_EQ(expected, table.get_total_size());
+  }
+  EXPECT_EQ(0, table.category_count());
+}
+
+TEST(wide_category_tree_test, integration_test) {
+  wide_category_tree <int, int, 4> tree;
+  const int element_count = (1 << 8) + (1 << 7);
+  for (int i = 0; i < element_count; ++i) {
+    const int adjusted = ((i + 19) * 13) % element_count;
+    tree.update_category(adjusted, 2);
+    EXPECT_EQ(2 * (i + 1), tree.get_total_size());
+    // (Yes, this makes it quadratic...)
+    EXPECT_TRUE(tree.validate_tree());
+  }
+  EXPECT_EQ(2 * element_count, tree.get_total_size());
+  for (int i = 0; i < tree.get_total_size(); ++i) {
+    EXPECT_EQ(i / 2, tree.locate(i));
+  }
+  for (int i = 0; i < element_count; ++i) {
+    EXPECT_TRUE(tree.category_exists(i));
+    EXPECT_EQ(2, tree.category_size(i));
+  }
+  tree.update_category(7, [](int x) { return 3*x; });
+  EXPECT_EQ(6, tree.category_size(7));
+  tree.update_category(7, 2);
+  for (int i = 0; i < element_count; ++i) {
+    const int adjusted = ((i + 7) * 19) % element_count;
+    EXPECT_TRUE(tree.category_exists(adjusted));
+    tree.erase_category(adjusted);
+    EXPECT_EQ(2 * (element_count - (i + 1)), tree.get_total_size());
+    EXPECT_FALSE(tree.category_exists(adjusted));
+    // (Yes, this makes it quadratic...)
+    EXPECT_TRUE(tree.validate_tree());
+  }
+  EXPECT_EQ(0, tree.get_total_size());
+  EXPECT_EQ(nullptr, tree.root);
+}
+
+TEST(wide_category_tree_test, random_operations) {
+  wide_category_tree <int, int> tree;
+  std::map <int, int> expected;
+  std::default_random_engine generator(11);
+  std::uniform_int_distribution <int> category_choice(0, 4999);
+  std::uniform_int_distribution <int> size_choice(0, 9);
+  for (int i = 0; i < 100000; ++i) {
+    const int category = category_choice(generator);
+    if (i % 3 == 0) {
+      tree.erase_category(category);
+      expected.erase(category);
+    } else {
+      const int size = size_choice(generator);
+      tree.update_category(category, size);
+      expected[category] = size;
+    }
+    if (i % 1000 == 0) {
+      ASSERT_TRUE(tree.validate_tree());
+    }
+  }
+  ASSERT_TRUE(tree.validate_tree());
+  int offset = 0;
+  auto next = expected.begin();
+  tree.for_each([&](int category, int size) {
+    ASSERT_TRUE(next != expected.end());
+    EXPECT_EQ(next->first, category);
+    EXPECT_EQ(next->second, size);
+    ++next;
+  });
+  EXPECT_TRUE(next == expected.end());
+  for (const auto &category : expected) {
+    EXPECT_EQ(category.second, tree.category_size(category.first));
+    for (int i = 0; i < category.second; ++i) {
+      EXPECT_EQ(category.first, tree.locate(offset + i));
+    }
+    offset += category.second;
+  }
+  EXPECT_EQ(offset, tree.get_total_size());
+}
+
+TEST(category_interner_test, dense_stable_ids) {
+  category_interner <std::string> interner;
+  EXPECT_EQ(0, interner.intern("B"));
+  EXPECT_EQ(1, interner.intern("A"));
+  EXPECT_EQ(0, interner.intern("B"));
+  std::uint32_t id = 7;
+  EXPECT_FALSE(interner.find_id("C", id));
+  EXPECT_EQ(7, id);
+  EXPECT_TRUE(interner.find_id("A", id));
+  EXPECT_EQ(1, id);
+  const std::string &first = interner.get_category(0);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(i + 2, interner.intern(std::string(100, 'x') + std::to_string(i)));
+  }
+  // References stay valid as more categories are interned.
+  EXPECT_EQ("B", first);
+  EXPECT_EQ(std::string(100, 'x') + "999", interner.get_category(1001));
+  EXPECT_EQ(1002, interner.size());
+}
+
+TEST(decayed_category_tree_test, matches_explicit_decay) {
+  decayed_category_tree <int> decayed;
+  std::map <int, double> expected;
+  std::default_random_engine generator(3);
+  std::uniform_int_distribution <int> category_choice(0, 99);
+  std::uniform_real_distribution <double> amount(0.5, 2.0);
+  for (int round = 0; round < 3000; ++round) {
+    for (int i = 0; i < 10; ++i) {
+      const int category = category_choice(generator);
+      const double added = amount(generator);
+      decayed.add_to_category(category, added);
+      expected[category] += added;
+    }
+    // Enough rounds to renormalize several times.
+    decayed.decay(0.5);
+    for (auto &category : expected) {
+      category.second *= 0.5;
+    }
+    ASSERT_GE(decayed.get_scale(), 1.0);
+  }
+  double expected_total = 0;
+  for (const auto &category : expected) {
+    EXPECT_NEAR(category.second, decayed.category_size(category.first), 1e-12 * category.second);
+    expected_total += category.second;
+  }
+  EXPECT_NEAR(expected_total, decayed.get_total_size(), 1e-12 * expected_total);
+
+  // locate gives the same categories as a tree of the actual sizes.
+  category_tree <int> actual;
+  decayed.for_each([&actual](int category, double size) {
+    actual.update_category(category, size);
+  });
+  for (int i = 0; i < 1000; ++i) {
+    const double position = actual.get_total_size() * i / 1000.0;
+    EXPECT_EQ(actual.locate(position), decayed.locate(position));
+  }
+  EXPECT_EQ(actual.locate(std::nextafter(actual.get_total_size(), 0.0)),
+            decayed.locate(std::nextafter(decayed.get_total_size(), 0.0)));
+
+  decayed.update_category(1000, 1.0);
+  EXPECT_DOUBLE_EQ(1.0, decayed.category_size(1000));
+  decayed.decay(0.25);
+  EXPECT_DOUBLE_EQ(0.25, decayed.category_size(1000));
+
+  // Categories that decay to 0 are erased when renormalizing, but not ones
+  // that were explicitly set to 0.
+  decayed.update_category(1002, 0.0);
+  for (int round = 0; round < 2000; ++round) {
+    decayed.decay(0.5);
+    decayed.add_to_category(1001, 1.0);
+  }
+  EXPECT_FALSE(decayed.category_exists(1000));
+  EXPECT_TRUE(decayed.category_exists(1001));
+  EXPECT_TRUE(decayed.category_exists(1002));
+  EXPECT_EQ(0.0, decayed.category_size(1002));
+  int remaining = 0;
+  decayed.get_categories().for_each([&remaining](int, double) { ++remaining; });
+  EXPECT_EQ(2, remaining);
+  decayed.erase_category(1000);
+  EXPECT_FALSE(decayed.category_exists(1000));
+}
+
+TEST(xoshiro_generator_test, streams) {
+  xoshiro256_starstar generator(1), same(1), other(2);
+  EXPECT_TRUE(generator == same);
+  EXPECT_TRUE(generator != other);
+  std::vector <std::uint64_t> first;
+  for (int i = 0; i < 100; ++i) {
+    first.push_back(generator());
+    EXPECT_EQ(first.back(), same());
+  }
+  // Jumping gives a different stream, but it's still deterministic.
+  xoshiro256_starstar jumped(1), jumped_again(1);
+  jumped.jump();
+  jumped_again.jump();
+  for (int i = 0; i < 100; ++i) {
+    const std::uint64_t next = jumped();
+    EXPECT_EQ(next, jumped_again());
+    EXPECT_TRUE(std::find(first.begin(), first.end(), next) == first.end());
+  }
+  // Works with the standard distributions.
+  std::uniform_real_distribution <double> uniform;
+  double sum = 0;
+  const int sample_count = 100000;
+  for (int i = 0; i < sample_count; ++i) {
+    sum += uniform(generator);
+  }
+  EXPECT_NEAR(0.5, sum / sample_count, 0.01);
+}
+
+TEST(philox_generator_test, known_answers_and_streams) {
+  // Known-answer tests from the Random123 distribution.
+  const philox4x32::block_type zeros =
+    philox4x32::block({{ 0, 0, 0, 0 }}, {{ 0, 0 }});
+  EXPECT_EQ((philox4x32::block_type {{ 0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 }}), zeros);
+  const philox4x32::block_type pi =
+    philox4x32::block({{ 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 }}, {{ 0xa4093822, 0x299f31d0 }});
+  EXPECT_EQ((philox4x32::block_type {{ 0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1 }}), pi);
+
+  // Any stream can be reproduced directly, in any order.
+  philox4x32 generator(12345);
+  std::vector <std::vector <std::uint32_t>> streams(10);
+  for (int stream = 0; stream < 10; ++stream) {
+    generator.set_stream(stream);
+    for (int i = 0; i < 9; ++i) {
+      streams[stream].push_back(generator());
+    }
+  }
+  EXPECT_NE(streams[0], streams[1]);
+  philox4x32 other(12345);
+  for (int stream = 9; stream >= 0; --stream) {
+    other.set_stream(stream);
+    for (int i = 0; i < 9; ++i) {
+      EXPECT_EQ(streams[stream][i], other());
+    }
+  }
+  philox4x32 different_seed(54321);
+  EXPECT_NE(streams[0][0], different_seed());
+}
+
 int main(int argc, char *argv[]) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,336 @@
+/* -----------------------------------------------------------------------------
+Copyright (c) 2017, Google Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+----------------------------------------------------------------------------- */
+
+// Author: Kevin P. Barry [ta0kira@gmail.com] [kevinbarry@google.com]
+
+// Usage: sampling-benchmark [category count...]
+// Compares category_tree with the simpler ways of sampling a categorical
+// distribution, for mixes of updates and samples, and then for erases. The
+// output is CSV, with one row per (structure, count, mix, operation). Latency
+// percentiles are per operation, after subtracting the overhead of reading
+// the clock. With no counts, 100 to 100K categories are used.
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alias-table.hpp"
+#include "category-tree.hpp"
+#include "wide-category-tree.hpp"
+
+namespace {
+
+// Keeps results "used" so that the optimizer can't discard the timed work.
+volatile long benchmark_sink = 0;
+
+// Categories in arbitrary order, with their sizes. Updates and erases are O(1)
+// using an index, and locate is an O(n) scan. The total is adjusted rather than
+// recomputed, since recomputing it would also be O(n).
+class linear_scan {
+public:
+  linear_scan() : total_size() {}
+
+  void update_category(int category, double size) {
+    const auto existing = index.find(category);
+    if (existing == index.end()) {
+      index.emplace(category, entries.size());
+      entries.emplace_back(category, size);
+      total_size += size;
+    } else {
+      total_size += size - entries[existing->second].second;
+      entries[existing->second].second = size;
+    }
+  }
+
+  void erase_category(int category) {
+    const auto existing = index.find(category);
+    if (existing == index.end()) return;
+    total_size -= entries[existing->second].second;
+    entries[existing->second] = entries.back();
+    index[entries.back().first] = existing->second;
+    entries.pop_back();
+    index.erase(existing);
+  }
+
+  int locate(double size) const {
+    for (const auto &entry : entries) {
+      if (size < entry.second) return entry.first;
+      size -= entry.second;
+    }
+    // Precision error; see category_node::locate.
+    return entries.back().first;
+  }
+
+  double get_total_size() const {
+    return total_size;
+  }
+
+private:
+  std::vector <std::pair <int, double>> entries;
+  std::unordered_map <int, std::size_t> index;
+  double total_size;
+};
+
+// Categories in sorted order with a running total of their sizes. locate is a
+// binary search, but an update recomputes the running totals after it, and
+// inserts and erases also shift the arrays, so those are O(n).
+class cumulative_sum {
+public:
+  void update_category(int category, double size) {
+    const std::size_t position =
+      std::lower_bound(categories.begin(), categories.end(), category) - categories.begin();
+    if (position == categories.size() || categories[position] != category) {
+      categories.insert(categories.begin() + position, category);
+      sizes.insert(sizes.begin() + position, size);
+      cumulative.insert(cumulative.begin() + position, 0.0);
+    } else {
+      sizes[position] = size;
+    }
+    this->recompute(position);
+  }
+
+  void erase_category(int category) {
+    const std::size_t position =
+      std::lower_bound(categories.begin(), categories.end(), category) - categories.begin();
+    if (position == categories.size() || categories[position] != category) return;
+    categories.erase(categories.begin() + position);
+    sizes.erase(sizes.begin() + position);
+    cumulative.erase(cumulative.begin() + position);
+    this->recompute(position);
+  }
+
+  int locate(double size) const {
+    std::size_t position =
+      std::upper_bound(cumulative.begin(), cumulative.end(), size) - cumulative.begin();
+    // Precision error; see category_node::locate.
+    if (position == categories.size()) --position;
+    return categories[position];
+  }
+
+  double get_total_size() const {
+    return cumulative.empty()? 0.0 : cumulative.back();
+  }
+
+private:
+  void recompute(std::size_t position) {
+    double total = (position == 0)? 0.0 : cumulative[position - 1];
+    for (; position < sizes.size(); ++position) {
+      cumulative[position] = (total += sizes[position]);
+    }
+  }
+
+  std::vector <int>    categories;
+  std::vector <double> sizes;
+  std::vector <double> cumulative;
+};
+
+// A category_tree for updates, plus an alias_table that's rebuilt in O(n) by
+// the first sample after any update. This is how action_timer uses snapshots,
+// minus the heuristic for when rebuilding pays off.
+class lazy_alias {
+public:
+  void update_category(int category, double size) {
+    categories.update_category(category, size);
+    table.reset();
+  }
+
+  void erase_category(int category) {
+    categories.erase_category(category);
+    table.reset();
+  }
+
+  int locate(double size) {
+    return this->get_table().locate(size);
+  }
+
+  // NOTE: This rebuilds the table if necessary, so that the position passed to
+  // locate is always relative to the table's own total.
+  double get_total_size() {
+    return this->get_table().get_total_size();
+  }
+
+private:
+  const alias_table <int> &get_table() {
+    if (!table) {
+      table.reset(new alias_table <int> (categories));
+    }
+    return *table;
+  }
+
+  category_tree <int> categories;
+  std::unique_ptr <const alias_table <int>> table;
+};
+
+using clock_type = std::chrono::steady_clock;
+
+double elapsed_ns(clock_type::time_point start, clock_type::time_point finish) {
+  return std::chrono::duration <double, std::nano> (finish - start).count();
+}
+
+// The median cost of reading the clock twice, which is subtracted from every
+// latency.
+double clock_overhead_ns() {
+  std::vector <double> samples(10000);
+  for (double &sample : samples) {
+    const auto start = clock_type::now();
+    sample = elapsed_ns(start, clock_type::now());
+  }
+  std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+  return samples[samples.size() / 2];
+}
+
+// Latencies of one type of operation.
+class latency_log {
+public:
+  explicit latency_log(double new_overhead) : overhead(new_overhead) {}
+
+  template <class Function>
+  void time(const Function &function) {
+    const auto start = clock_type::now();
+    function();
+    latencies.push_back(std::max(0.0, elapsed_ns(start, clock_type::now()) - overhead));
+  }
+
+  // CSV columns: operation,ops,ns_per_op,p50_ns,p99_ns,p999_ns
+  void print(const char *structure, std::size_t count, const char *mix, const char *operation) {
+    if (latencies.empty()) return;
+    double total = 0;
+    for (double latency : latencies) total += latency;
+    std::sort(latencies.begin(), latencies.end());
+    printf("%s,%zu,%s,%s,%zu,%.1f,%.1f,%.1f,%.1f\n", structure, count, mix, operation,
+           latencies.size(), total / latencies.size(), this->percentile(0.5),
+           this->percentile(0.99), this->percentile(0.999));
+  }
+
+private:
+  double percentile(double fraction) const {
+    return latencies[(std::size_t) (fraction * (latencies.size() - 1))];
+  }
+
+  const double overhead;
+  std::vector <double> latencies;
+};
+
+struct operation_mix {
+  const char *label;
+  int updates, samples;
+};
+
+const std::size_t op_count = 10000;
+
+template <class Structure>
+void run_mix(const char *structure_label, std::size_t count, const operation_mix &mix,
+             double overhead) {
+  std::default_random_engine generator(count);
+  std::uniform_int_distribution <int> category_choice(0, count - 1);
+  std::uniform_real_distribution <double> new_size(0.5, 10.0);
+  Structure structure;
+  for (std::size_t i = 0; i < count; ++i) {
+    structure.update_category(i, 1.0 + i % 7);
+  }
+
+  latency_log updates(overhead), locates(overhead), erases(overhead);
+  long sum = 0;
+  for (std::size_t done = 0; done < op_count; done += mix.updates + mix.samples) {
+    for (int i = 0; i < mix.updates; ++i) {
+      const int category = category_choice(generator);
+      const double size = new_size(generator);
+      updates.time([&] { structure.update_category(category, size); });
+    }
+    for (int i = 0; i < mix.samples; ++i) {
+      // NOTE: get_total_size is timed along with locate, since lazy_alias
+      // rebuilds its table there after an update.
+      locates.time([&] {
+        sum += structure.locate(uniform_position(structure.get_total_size(), generator));
+      });
+    }
+  }
+
+  std::vector <int> erased(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    erased[i] = i;
+  }
+  std::shuffle(erased.begin(), erased.end(), generator);
+  erased.resize(std::min(count, op_count));
+  for (int category : erased) {
+    erases.time([&] { structure.erase_category(category); });
+  }
+  benchmark_sink = sum;
+
+  updates.print(structure_label, count, mix.label, "update");
+  locates.print(structure_label, count, mix.label, "locate");
+  erases.print(structure_label, count, mix.label, "erase");
+}
+
+const operation_mix all_mixes[] = {
+  { "0:1",   0,  1 },
+  { "1:100", 1, 100 },
+  { "1:10",  1, 10 },
+  { "1:1",   1,  1 },
+  { "10:1", 10,  1 },
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::vector <std::size_t> counts;
+  for (int i = 1; i < argc; ++i) {
+    char *end = nullptr;
+    const unsigned long count = strtoul(argv[i], &end, 10);
+    if (!*argv[i] || *end || count == 0) {
+      fprintf(stderr, "%s: Invalid category count \"%s\".\n", argv[0], argv[i]);
+      return 1;
+    }
+    counts.push_back(count);
+  }
+  if (counts.empty()) {
+    counts = { 100, 1000, 10000, 100000 };
+  }
+
+  const double overhead = clock_overhead_ns();
+  printf("structure,categories,updates_to_samples,operation,ops,ns_per_op,p50_ns,p99_ns,p999_ns\n");
+  for (std::size_t count : counts) {
+    for (const operation_mix &mix : all_mixes) {
+      run_mix <category_tree <int>>      ("category_tree",  count, mix, overhead);
+      run_mix <wide_category_tree <int>> ("wide_tree",      count, mix, overhead);
+      run_mix <linear_scan>              ("linear_scan",    count, mix, overhead);
+      run_mix <cumulative_sum>           ("cumulative_sum", count, mix, overhead);
+      run_mix <lazy_alias>               ("alias_table",    count, mix, overhead);
+      fflush(stdout);
+    }
+  }
+}